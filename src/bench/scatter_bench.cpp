@@ -0,0 +1,85 @@
+// Times the scatter functions of kernels/scatter_bench.cl, built once with the
+// closed-form samplers and once with -DREJECTION_SAMPLING.
+//
+// Usage: scatter_bench [work-items] [iterations]
+// Run it from the repository root, like CRT.
+
+#include "host/CLBuffer.h"
+#include "host/CLKernel.h"
+#include "host/CLUtil.h"
+#include "host/Utils.h"
+
+#include "common/camera.h"
+#include "common/metal.h"
+#include "common/texture.h"
+
+#include <CL/cl.h>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace std::chrono;
+
+// Best of a few runs, in ms.
+double timeKernel(cl_command_queue queue, cl_kernel kernel, size_t workItems) {
+  double best = 1e30;
+  for(int run = 0; run < 5; run++) {
+    auto start = high_resolution_clock::now();
+    clErr(clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &workItems, nullptr, 0, nullptr, nullptr));
+    clErr(clFinish(queue));
+    double ms = duration_cast<microseconds>(high_resolution_clock::now() - start).count() / 1000.0;
+    if(run > 0) best = std::min(best, ms); // The first run warms up.
+  }
+  return best;
+}
+
+int main(int argc, const char** argv) {
+  size_t workItems = argc > 1 ? std::atol(argv[1]) : 1 << 20;
+  int iterations = argc > 2 ? std::atoi(argv[2]) : 64;
+
+  auto [context, queue, device] = setupCL();
+
+  Texture::SolidColor(f3(0.5, 0.5, 0.5));
+  Metal::push_back({f3(0.8, 0.8, 0.8), 0.5});
+  CLBuffer<Texture> textures = CLBuffer<Texture>::fromVector(context, queue, Texture::instances);
+  CLBuffer<Metal> metals = CLBuffer<Metal>::fromVector(context, queue, Metal::instances);
+  textures.uploadToDevice(context);
+  metals.uploadToDevice(context);
+
+  Camera camera;
+  camera.aperature = 0.1;
+  camera.initialize(16.0f / 9.0f);
+
+  cl_int err;
+  cl_mem out = clCreateBuffer(context, CL_MEM_WRITE_ONLY, workItems * sizeof(float3), nullptr, &err);
+  clErr(err);
+
+  std::cout << fmt("%zu work-items, %d scatters each\n", workItems, iterations);
+
+  for(bool rejection : {false, true}) {
+    std::vector<std::string> defines;
+    if(rejection) defines.push_back("REJECTION_SAMPLING");
+    cl_program program = buildProgram("src/kernels/scatter_bench.cl", context, device, {"./src"}, defines);
+
+    auto bench = [&](const char* name, auto arg) {
+      cl_kernel kernel = clCreateKernel(program, name, &err);
+      clErr(err);
+      kernelParameters(kernel, 0, out, iterations, arg);
+
+      double ms = timeKernel(queue, kernel, workItems);
+      std::cout << fmt("%-10s %-18s %8.2f ms, %7.1f M scatters/s\n", rejection ? "rejection" : "closed", name, ms,
+                       workItems * iterations / ms / 1000.0);
+      clReleaseKernel(kernel);
+    };
+
+    bench("bench_lambertian", textures);
+    bench("bench_metal", metals);
+    bench("bench_camera", camera);
+
+    clReleaseProgram(program);
+  }
+
+  clReleaseMemObject(out);
+  return 0;
+}
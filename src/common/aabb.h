@@ -66,6 +66,14 @@ const Interval axis(global const AABB* aabb, int n) {
 	return aabb->x;
 }
 
+AABB aabb_union(AABB a, AABB b) {
+	AABB r;
+	r.x = interval(min(a.x.min, b.x.min), max(a.x.max, b.x.max));
+	r.y = interval(min(a.y.min, b.y.min), max(a.y.max, b.y.max));
+	r.z = interval(min(a.z.min, b.z.min), max(a.z.max, b.z.max));
+	return r;
+}
+
 #define comp(vec, idx)   	\
 	((idx == 0? vec.x : ((idx == 1)? vec.y : vec.z)))
 
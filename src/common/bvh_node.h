@@ -1,4 +1,7 @@
+#pragma once
+
 #include "common/aabb.h"
+#include "common/bvh_stats.h"
 #include "common/common_defs.h"
 #include "common/sphere.h"
 #include "common/interval.h"
@@ -11,6 +14,9 @@
 #include <vector>
 #endif
 
+// Entries in `bvh_intersect`'s stack. Trees deeper than this can lose nodes.
+#define BVH_STACK_SIZE 32
+
 // https://jacco.ompf2.com/2022/06/03/how-to-build-a-bvh-part-9a-to-the-gpu/
 SHARED_STRUCT_START(BVHNode) {
 	// sphere_count = 0 for non-leaf nodes, > 0 otherwise.
@@ -20,14 +26,28 @@ SHARED_STRUCT_START(BVHNode) {
 	AABB bounds;
 } SHARED_STRUCT_END(BVHNode);
 
+// Same tree as `BVHNode`, laid out depth-first by `SkipLinkBVH`
+// (host/SkipLinkBVH.h) so it can be traversed without a stack.
+// A node's first child is the next node in the array. So is the next node to
+// visit after a leaf, or after an internal node the ray hits. A ray that misses
+// an internal node jumps to first_skip, the first node after its subtree.
+// Jumping to or past the end of the array ends the traversal.
+SHARED_STRUCT_START(BVHSkipNode) {
+	// sphere_count = 0 for non-leaf nodes, > 0 otherwise.
+	// first_skip = skip link if not leaf.
+	// 						= offset of first sphere if leaf.
+	uint first_skip, sphere_count;
+	AABB bounds;
+} SHARED_STRUCT_END(BVHSkipNode);
+
 #ifdef OPENCL
 
 #include "device/hit_record.h"
 #include "device/ray.h"
 #include "device/cl_util.cl"
 
-bool bvh_intersect(global BVHNode* bvh_node, global Sphere* spheres, Ray* ray, Interval* ray_t, HitRecord* rec) {
-	global BVHNode* node = &bvh_node[0], *stack[32];
+bool bvh_intersect(global BVHNode* bvh_node, global Sphere* spheres, Ray* ray, Interval* ray_t, HitRecord* rec BVH_STATS_PARAM) {
+	global BVHNode* node = &bvh_node[0], *stack[BVH_STACK_SIZE];
 	uint stack_ptr = 0;
 
 	bool hit_anything = false;
@@ -35,10 +55,14 @@ bool bvh_intersect(global BVHNode* bvh_node, global Sphere* spheres, Ray* ray, I
 
 	if(node->left_first == 0  && node->sphere_count == 0) return false;
 
+	BVH_STATS_BEGIN;
+
 	while(1) {
+		BVH_STAT(stat_nodes, 1);
 		
 		// Leaf
 		if(node->sphere_count > 0) {
+			BVH_STAT(stat_spheres, node->sphere_count);
 #if 1
 			if(closest_hit(spheres + node->left_first, node->sphere_count, *ray , ray_t, &temp_rec)) {
 				*rec = temp_rec;
@@ -64,6 +88,7 @@ bool bvh_intersect(global BVHNode* bvh_node, global Sphere* spheres, Ray* ray, I
 
 		float dist1 = aabb_hit(&child1->bounds, ray, *ray_t);
 		float dist2 = aabb_hit(&child2->bounds, ray, *ray_t);
+		BVH_STAT(stat_boxes, 2);
 
 		if(dist1 > dist2) {
 				SWAP(dist1, dist2, float);
@@ -77,6 +102,40 @@ bool bvh_intersect(global BVHNode* bvh_node, global Sphere* spheres, Ray* ray, I
 			if(dist2 < infinity) PUSH_STACK(child2);
 		}
 	}
+
+	BVH_STATS_END;
+	return hit_anything;
+}
+
+// Visits the children in the order they were laid out rather than nearest
+// first, but needs no stack and can't overflow on deep trees.
+bool bvh_skip_intersect(global BVHSkipNode* nodes, uint node_count, global Sphere* spheres, Ray* ray, Interval* ray_t, HitRecord* rec BVH_STATS_PARAM) {
+	bool hit_anything = false;
+	HitRecord temp_rec;
+
+	BVH_STATS_BEGIN;
+
+	uint index = 0;
+	while(index < node_count) {
+		global BVHSkipNode* node = &nodes[index];
+
+		bool hit_box = aabb_hit(&node->bounds, ray, *ray_t) < infinity;
+		bool leaf = node->sphere_count > 0;
+		BVH_STAT(stat_nodes, 1);
+		BVH_STAT(stat_boxes, 1);
+
+		if(hit_box && leaf) {
+			BVH_STAT(stat_spheres, node->sphere_count);
+			if(closest_hit(spheres + node->first_skip, node->sphere_count, *ray, ray_t, &temp_rec)) {
+				*rec = temp_rec;
+				hit_anything = true;
+			}
+		}
+
+		index = (hit_box || leaf) ? index + 1 : node->first_skip;
+	}
+
+	BVH_STATS_END;
 	return hit_anything;
 }
 #endif
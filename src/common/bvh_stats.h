@@ -0,0 +1,39 @@
+#pragma once
+
+// Traversal counters filled in by kernels built with -DBVH_STATS, one ulong
+// each in the stats buffer. See host/BVHStats.h for the report.
+#define BVH_STAT_TRAVERSALS      0
+#define BVH_STAT_NODE_VISITS     1
+#define BVH_STAT_BOX_TESTS       2
+#define BVH_STAT_SPHERE_TESTS    3
+// Most node visits of a single traversal.
+#define BVH_STAT_MAX_NODE_VISITS 4
+#define BVH_STAT_COUNT           5
+
+#ifdef OPENCL
+#ifdef BVH_STATS
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+#pragma OPENCL EXTENSION cl_khr_int64_extended_atomics : enable
+
+// Threads the stats buffer from the kernel down to the traversal.
+#define BVH_STATS_PARAM , global ulong* bvh_stats
+#define BVH_STATS_ARG , bvh_stats
+
+// Counted in private memory, then flushed once per traversal so the atomics
+// don't serialize every node visit.
+#define BVH_STATS_BEGIN uint stat_nodes = 0, stat_boxes = 0, stat_spheres = 0
+#define BVH_STAT(counter, n) counter += (n)
+#define BVH_STATS_END                                          \
+	atom_inc(&bvh_stats[BVH_STAT_TRAVERSALS]);                   \
+	atom_add(&bvh_stats[BVH_STAT_NODE_VISITS], stat_nodes);      \
+	atom_add(&bvh_stats[BVH_STAT_BOX_TESTS], stat_boxes);        \
+	atom_add(&bvh_stats[BVH_STAT_SPHERE_TESTS], stat_spheres);   \
+	atom_max(&bvh_stats[BVH_STAT_MAX_NODE_VISITS], stat_nodes)
+#else
+#define BVH_STATS_PARAM
+#define BVH_STATS_ARG
+#define BVH_STATS_BEGIN
+#define BVH_STAT(counter, n)
+#define BVH_STATS_END
+#endif
+#endif
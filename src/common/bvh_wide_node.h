@@ -0,0 +1,225 @@
+#pragma once
+
+#include "common/bvh_node.h"
+#include "common/common_defs.h"
+
+#ifndef OPENCL
+#include "host/CLUtil.h"
+#endif
+
+// Collapsed 4-wide and 8-wide BVH nodes, built from a binary `BVHNode` tree by
+// `WideBVH` (host/WideBVH.h).
+// Child bounds are stored SoA, one vector per slab plane, so one node fetch
+// tests every child at once with vector ops.
+//
+// child[i] = index of the child node, or of the first sphere if it's a leaf.
+// count[i] = sphere count for leaves, 0 for internal children.
+// Unused slots have child[i] = BVH_WIDE_EMPTY.
+#define BVH_WIDE_EMPTY 0xFFFFFFFF
+
+// Entries of the traversal stack of `bvh_wide_intersect`. Up to width - 1
+// get pushed per level, `WideBVH` checks its trees fit.
+#define BVH_WIDE_STACK_ENTRIES(width) (16 * (width))
+
+SHARED_STRUCT_START(BVH4Node) {
+	float4 min_x, max_x, min_y, max_y, min_z, max_z;
+	uint4 child, count;
+} SHARED_STRUCT_END(BVH4Node);
+
+SHARED_STRUCT_START(BVH8Node) {
+	float8 min_x, max_x, min_y, max_y, min_z, max_z;
+	uint8 child, count;
+} SHARED_STRUCT_END(BVH8Node);
+
+// Compressed versions of the nodes above, after Ylitie et al., "Efficient
+// Incoherent Ray Traversal on GPUs Through Compressed Wide BVHs", 2017.
+// Child planes are quantized to 8 bits on a per node grid:
+//   plane = origin + q * 2^(exponent - 127)
+// Mins are rounded down and maxes up, so a decoded box always contains the
+// real one. The grid step is a power of two, which makes decoding exact.
+// child/count mean the same as above.
+SHARED_STRUCT_START(BVH4CompressedNode) {
+	uint4 child;
+	float origin_x, origin_y, origin_z;
+	// Biased like a float exponent, one per axis. w is unused.
+	uchar4 exponent;
+	uchar4 lo_x, hi_x, lo_y, hi_y, lo_z, hi_z;
+	ushort4 count;
+} SHARED_STRUCT_END(BVH4CompressedNode);
+
+// 112 bytes of data, padded to 128 by the alignment of uint8.
+SHARED_STRUCT_START(BVH8CompressedNode) {
+	uint8 child;
+	float origin_x, origin_y, origin_z;
+	uchar4 exponent;
+	uchar8 lo_x, hi_x, lo_y, hi_y, lo_z, hi_z;
+	ushort8 count;
+} SHARED_STRUCT_END(BVH8CompressedNode);
+
+#ifdef OPENCL
+
+#include "device/hit_record.h"
+#include "device/ray.h"
+#include "device/cl_util.cl"
+
+// Picked at kernel build time with -DBVH_WIDTH={2,4,8}, plus -DBVH_COMPRESSED
+// for the quantized nodes.
+#ifndef BVH_WIDTH
+#define BVH_WIDTH 2
+#endif
+
+#if BVH_WIDTH == 8
+#ifdef BVH_COMPRESSED
+typedef BVH8CompressedNode BVHWideNode;
+#else
+typedef BVH8Node BVHWideNode;
+#endif
+#define floatW float8
+#define intW int8
+#define vstoreW vstore8
+#define convert_floatW convert_float8
+#define convert_uintW convert_uint8
+#elif BVH_WIDTH == 4
+#ifdef BVH_COMPRESSED
+typedef BVH4CompressedNode BVHWideNode;
+#else
+typedef BVH4Node BVHWideNode;
+#endif
+#define floatW float4
+#define intW int4
+#define vstoreW vstore4
+#define convert_floatW convert_float4
+#define convert_uintW convert_uint4
+#endif
+
+#if BVH_WIDTH > 2
+
+#define BVH_WIDE_STACK_SIZE BVH_WIDE_STACK_ENTRIES(BVH_WIDTH)
+
+typedef struct {
+	uint index, count;
+	float dist;
+} WideStackEntry;
+
+void bvh_wide_child_bounds(
+	global const BVHWideNode* node,
+	floatW* min_x, floatW* max_x,
+	floatW* min_y, floatW* max_y,
+	floatW* min_z, floatW* max_z
+) {
+#ifdef BVH_COMPRESSED
+	// 2^(e - 127) is just e shifted into a float's exponent bits.
+	float4 scale = as_float4(convert_uint4(node->exponent) << 23);
+
+	*min_x = node->origin_x + convert_floatW(node->lo_x) * scale.x;
+	*max_x = node->origin_x + convert_floatW(node->hi_x) * scale.x;
+	*min_y = node->origin_y + convert_floatW(node->lo_y) * scale.y;
+	*max_y = node->origin_y + convert_floatW(node->hi_y) * scale.y;
+	*min_z = node->origin_z + convert_floatW(node->lo_z) * scale.z;
+	*max_z = node->origin_z + convert_floatW(node->hi_z) * scale.z;
+#else
+	*min_x = node->min_x; *max_x = node->max_x;
+	*min_y = node->min_y; *max_y = node->max_y;
+	*min_z = node->min_z; *max_z = node->max_z;
+#endif
+}
+
+bool bvh_wide_intersect(global BVHWideNode* nodes, global Sphere* spheres, Ray* ray, Interval* ray_t, HitRecord* rec BVH_STATS_PARAM) {
+	WideStackEntry stack[BVH_WIDE_STACK_SIZE];
+	uint stack_ptr = 0;
+
+	bool hit_anything = false;
+	HitRecord temp_rec;
+
+	float3 inv_d = 1.0f / ray->d;
+
+	// The root is always an inner node, even if it only has a single leaf.
+	WideStackEntry entry = {0, 0, 0};
+
+	BVH_STATS_BEGIN;
+
+	while(1) {
+		// Entries pushed before a closer hit was found may be behind it by now.
+		if(entry.dist < ray_t->max) {
+
+			// Leaf
+			if(entry.count > 0) {
+				BVH_STAT(stat_spheres, entry.count);
+				if(closest_hit(spheres + entry.index, entry.count, *ray, ray_t, &temp_rec)) {
+					*rec = temp_rec;
+					hit_anything = true;
+				}
+			} else {
+				global BVHWideNode* node = &nodes[entry.index];
+				BVH_STAT(stat_nodes, 1);
+				BVH_STAT(stat_boxes, BVH_WIDTH);
+
+				floatW min_x, max_x, min_y, max_y, min_z, max_z;
+				bvh_wide_child_bounds(node, &min_x, &max_x, &min_y, &max_y, &min_z, &max_z);
+
+				floatW tx0 = (min_x - ray->o.x) * inv_d.x, tx1 = (max_x - ray->o.x) * inv_d.x;
+				floatW ty0 = (min_y - ray->o.y) * inv_d.y, ty1 = (max_y - ray->o.y) * inv_d.y;
+				floatW tz0 = (min_z - ray->o.z) * inv_d.z, tz1 = (max_z - ray->o.z) * inv_d.z;
+
+				floatW tmin = fmax(fmax(fmin(tx0, tx1), fmin(ty0, ty1)), fmin(tz0, tz1));
+				floatW tmax = fmin(fmin(fmax(tx0, tx1), fmax(ty0, ty1)), fmax(tz0, tz1));
+
+				intW hit_mask = (tmax >= tmin) & (tmin < ray_t->max) & (tmax > 0) & (node->child != BVH_WIDE_EMPTY);
+
+				float dist[BVH_WIDTH];
+				int hit[BVH_WIDTH];
+				uint child[BVH_WIDTH], count[BVH_WIDTH];
+				vstoreW(tmin, 0, dist);
+				vstoreW(hit_mask, 0, hit);
+				vstoreW(node->child, 0, child);
+				vstoreW(convert_uintW(node->count), 0, count);
+
+				// Insertion sort of the children that were hit, farthest first.
+				WideStackEntry sorted[BVH_WIDTH];
+				uint hits = 0;
+				for(int i = 0; i < BVH_WIDTH; i++) {
+					if(!hit[i]) continue;
+
+					WideStackEntry e = {child[i], count[i], dist[i]};
+					int j = hits++;
+					while(j > 0 && sorted[j - 1].dist < e.dist) {
+						sorted[j] = sorted[j - 1];
+						j--;
+					}
+					sorted[j] = e;
+				}
+
+				if(hits > 0) {
+					// Push the far ones so the nearest is popped first. The host made
+					// sure they fit, see `WideBVH::stackError`.
+					for(uint i = 0; i < hits - 1; i++) {
+						PUSH_STACK(sorted[i]);
+					}
+					entry = sorted[hits - 1];
+					continue;
+				}
+			}
+		}
+
+		POP_STACK(entry);
+	}
+
+	BVH_STATS_END;
+	return hit_anything;
+}
+#endif
+
+// What kernels should use, so they don't care about the node format.
+// Add -DBVH_SKIP_LINKS to traverse `BVHSkipNode`s, only with BVH_WIDTH 2.
+#if BVH_WIDTH > 2
+typedef BVHWideNode BVHTraversalNode;
+#define bvh_traverse(nodes, node_count, spheres, ray, ray_t, rec) bvh_wide_intersect(nodes, spheres, ray, ray_t, rec BVH_STATS_ARG)
+#elif defined(BVH_SKIP_LINKS)
+typedef BVHSkipNode BVHTraversalNode;
+#define bvh_traverse(nodes, node_count, spheres, ray, ray_t, rec) bvh_skip_intersect(nodes, node_count, spheres, ray, ray_t, rec BVH_STATS_ARG)
+#else
+typedef BVHNode BVHTraversalNode;
+#define bvh_traverse(nodes, node_count, spheres, ray, ray_t, rec) bvh_intersect(nodes, spheres, ray, ray_t, rec BVH_STATS_ARG)
+#endif
+
+#endif
@@ -38,7 +38,11 @@ SHARED_STRUCT_START(Lambertian) {
 #include "device/ray.h"
 
 bool lambertian_scatter(uint texture_index, global const Texture* textures, const Ray* r_in, const HitRecord* rec, float3* attenuation, Ray* scattered, uint2* private seed) {
+#ifdef REJECTION_SAMPLING
   float3 scatter_direction = rec->normal + random_unit_vector(seed);
+#else
+  float3 scatter_direction = random_cosine_direction(rec->normal, seed);
+#endif
 
   if(float3_near_zero(scatter_direction)) {
     scatter_direction = rec->normal;
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "common/common_defs.h"
+#include "common/material_id.h"
+
+#ifndef OPENCL
+#include "host/CLUtil.h"
+#endif
+
+// Same cap as the megakernel's MAX_DEPTH, the host needs it to know how many
+// bounces to enqueue.
+#define WF_MAX_DEPTH 64
+
+// Slots of the wavefront counters buffer.
+// WF_RAY_COUNT: rays waiting in the current ray queue.
+// WF_NEXT_RAY_COUNT: rays pushed into the next ray queue by the shade kernels.
+// WF_MATERIAL_COUNT + type: hits waiting in that material's queue.
+// With -DWF_SORT_HITS:
+// WF_MATERIAL_START + type: where that material's queue starts.
+// WF_HIT_COUNT: hits waiting to be sorted.
+#define WF_RAY_COUNT 0
+#define WF_NEXT_RAY_COUNT 1
+#define WF_MATERIAL_COUNT 2
+#define WF_MATERIAL_TYPES 3
+#define WF_MATERIAL_START (WF_MATERIAL_COUNT + WF_MATERIAL_TYPES)
+#define WF_HIT_COUNT (WF_MATERIAL_START + WF_MATERIAL_TYPES)
+#define WF_COUNTER_COUNT (WF_HIT_COUNT + 1)
+
+// One path of the wavefront integrator (kernels/wavefront.cl), one per pixel.
+// The queues only hold indices into the path array.
+SHARED_STRUCT_START(PathState) {
+	// Ray to extend next.
+	float3 origin, direction;
+	// Product of the attenuations so far.
+	float3 throughput;
+	// What the path adds to its pixel if it stops now.
+	float3 radiance;
+
+	// Closest hit found by wf_extend, for the wf_shade_* kernels.
+	float3 hit_p, hit_normal;
+	float2 hit_uv;
+	uint hit_front_face;
+	MaterialId hit_mat_id;
+
+	uint2 seed;
+	uint depth;
+} SHARED_STRUCT_END(PathState);
@@ -24,6 +24,11 @@ SHARED_STRUCT_START(Sphere) {
 	inline static std::vector<Sphere> instances;
 
 	Sphere(float3 center, float radius, MaterialId id): center(center), radius(radius), mat_id(id) {
+		updateBBox();
+	}
+
+	// Call after moving or resizing the sphere.
+	void updateBBox() {
 		float3 rvec = f3(radius, radius, radius);
 		bbox = AABB(center - rvec, center + rvec);
 	}
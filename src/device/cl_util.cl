@@ -2,23 +2,7 @@
 
 #ifdef OPENCL
 #include "cl_def.cl"
-
-// https://stackoverflow.com/a/16077942
-float random_float(uint2* private  seed) {
-
-	const float invMaxInt = 1.0f/4294967296.0f;
-
-	uint x = (*seed).x * 17 + (*seed).y * 13123;
-	(*seed).x = (x<<13) ^ x;
-	(*seed).y ^= (x<<7);
-
-	uint tmp =  
-		(x * (x * x * 15731 + 74323) + 871483) 
-		+ (x * (x * x * 13734 + 37828) + 234234) 
-		+ (x * (x * x * 11687 + 26461) + 137589);
-
-	return convert_float(tmp) * invMaxInt;
-}
+#include "device/sampler.h"
 
 float random_float_ranged(uint2* private  seed1, float min, float max) {
 	return min + (max-min) * random_float(seed1);
@@ -36,19 +20,87 @@ float3 random_float3_ranged(uint2* private  seed, float min, float max) {
 	};
 }
 
+// Closed-form samplers. Each one takes a fixed number of draws, so the
+// work-items of a SIMD group stay in lockstep and the draws of a bounce keep
+// their dimensions in the sampler.
+float3 closed_form_unit_vector(uint2* private  seed) {
+	float z = 1 - 2 * random_float(seed);
+	float phi = 2 * M_PI_F * random_float(seed);
+	float r = sqrt(max(1 - z * z, 0.0f));
+
+	return (float3)(r * cos(phi), r * sin(phi), z);
+}
+
+// Uniform direction, with the cube root of a uniform radius.
+float3 closed_form_in_unit_sphere(uint2* private  seed) {
+	float3 direction = closed_form_unit_vector(seed);
+	return cbrt(random_float(seed)) * direction;
+}
+
+// Shirley and Chiu, "A Low Distortion Map Between Disk and Square", 1997.
+float3 closed_form_in_unit_disk(uint2* private seed) {
+	float a = 2 * random_float(seed) - 1;
+	float b = 2 * random_float(seed) - 1;
+
+	bool outer_x = fabs(a) > fabs(b);
+	float r = outer_x ? a : b;
+	// b == 0 here only if a == 0 too, then r is 0 and phi doesn't matter.
+	float phi = outer_x ? M_PI_4_F * (b / a) : M_PI_2_F - M_PI_4_F * (a / (b != 0 ? b : 1));
+
+	return (float3)(r * cos(phi), r * sin(phi), 0);
+}
+
+#ifdef REJECTION_SAMPLING
+// The original rejection samplers, built with -DREJECTION_SAMPLING to compare
+// images against them.
+//
+// A bounce has 2^RNG_DRAW_BITS draws, past that they'd run into the next
+// bounce's. So the loops give up after REJECTION_MAX_TRIES and take the
+// closed-form sample instead, which is just as uniform. A bounce draws at
+// most a scatter and the russian roulette, the camera ray the jitter and
+// the lens.
+#define REJECTION_MAX_TRIES 16
+#if 3 * REJECTION_MAX_TRIES + 3 + 1 > (1 << RNG_DRAW_BITS)
+#error "REJECTION_MAX_TRIES takes more draws than a bounce has"
+#endif
+
 float3 random_in_unit_sphere(uint2* private  seed) {
-	while(true) {
+	for(int i = 0; i < REJECTION_MAX_TRIES; i++) {
 		float3 p = random_float3_ranged(seed, -1, 1);
 		if(length(p) * length(p) >= 1) continue;
 
 		return p;
 	}
+	return closed_form_in_unit_sphere(seed);
 }
 
 float3 random_unit_vector(uint2* private  seed) {
 	return normalize(random_in_unit_sphere(seed));
 }
 
+float3 random_in_unit_disk(uint2* private seed) {
+	for(int i = 0; i < REJECTION_MAX_TRIES; i++) {
+		float3 p = (float3){random_float_ranged(seed, -1, 1), random_float_ranged(seed, -1, 1), 0.0f};
+		if(length(p) * length(p) >= 1) continue;
+
+		return p;
+	}
+	return closed_form_in_unit_disk(seed);
+}
+#else
+float3 random_unit_vector(uint2* private  seed) {
+	return closed_form_unit_vector(seed);
+}
+
+float3 random_in_unit_sphere(uint2* private  seed) {
+	return closed_form_in_unit_sphere(seed);
+}
+
+float3 random_in_unit_disk(uint2* private seed) {
+	return closed_form_in_unit_disk(seed);
+}
+#endif
+
 float3 random_in_hemisphere(float3 normal, uint2* private  seed) {
 	float3 in_unit_sphere = random_in_unit_sphere(seed);
 
@@ -59,13 +111,27 @@ float3 random_in_hemisphere(float3 normal, uint2* private  seed) {
 	}
 }
 
-float3 random_in_unit_disk(uint2* private seed) {
-	while(true) {
-		float3 p = (float3){random_float_ranged(seed, -1, 1), random_float_ranged(seed, -1, 1), 0.0f};
-		if(length(p) * length(p) >= 1) continue;
+// Orthonormal `t`, `b` around the unit vector `n`.
+// Duff et al., "Building an Orthonormal Basis, Revisited", 2017.
+void orthonormal_basis(float3 n, float3* t, float3* b) {
+	float s = copysign(1.0f, n.z);
+	float a = -1.0f / (s + n.z);
+	float c = n.x * n.y * a;
 
-		return p;
-	}
+	*t = (float3)(1 + s * n.x * n.x * a, s * c, -s * n.x);
+	*b = (float3)(c, s + n.y * n.y * a, -n.y);
+}
+
+// Cosine-weighted direction around the unit vector `normal`.
+float3 random_cosine_direction(float3 normal, uint2* private seed) {
+	float u = random_float(seed);
+	float phi = 2 * M_PI_F * random_float(seed);
+	float r = sqrt(u);
+
+	float3 t, b;
+	orthonormal_basis(normal, &t, &b);
+
+	return r * cos(phi) * t + r * sin(phi) * b + sqrt(1 - u) * normal;
 }
 
 bool float3_near_zero(float3 v) {
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "device/cl_util.cl"
+
+// Russian roulette, built in with -DRUSSIAN_ROULETTE_MIN_DEPTH=n.
+// After n bounces a path survives with probability max(throughput), and the
+// survivors' throughput is divided by it, so the estimate stays unbiased.
+// Returns false if the path stops here.
+bool russian_roulette(int depth, float3* throughput, uint2* private seed) {
+#ifdef RUSSIAN_ROULETTE_MIN_DEPTH
+	if(depth < RUSSIAN_ROULETTE_MIN_DEPTH) return true;
+
+	float p = min(max(throughput->x, max(throughput->y, throughput->z)), 1.0f);
+	if(random_float(seed) >= p) return false;
+
+	*throughput /= p;
+#endif
+	return true;
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+// The random numbers of the kernels. Everything draws through random_float,
+// which is one of these, picked when the kernels are built:
+// 	default               Hashed white noise.
+// 	-DSAMPLER_SOBOL       Owen-scrambled Sobol, per pixel.
+// 	-DSAMPLER_BLUE_NOISE  The same Sobol points, handed to the pixels of a
+// 	                      tile in a scrambled Morton order so the error is
+// 	                      spread like blue noise. Needs SAMPLER_SAMPLE_BITS.
+//
+// Nothing is kept between launches, a state names the draw:
+// 	x: the pixel index (the sequence index with SAMPLER_BLUE_NOISE)
+// 	y: the sample index (20 bits, the tile with SAMPLER_BLUE_NOISE), then
+// 	   RNG_BOUNCE_BITS for the bounce and RNG_DRAW_BITS counting the draws
+// 	   within it.
+// So a sample gets the same numbers however the samples are split over
+// launches, and a bounce gets the same numbers whatever the bounces before it
+// drew.
+// With SAMPLER_SOBOL the sample index is the index into the sequence, so
+// every sampler takes at most 2^20 samples per pixel (maxSamplesPerPixel on
+// the host).
+#define RNG_DRAW_BITS 6
+#define RNG_BOUNCE_BITS 6
+#define RNG_SAMPLE_SHIFT (RNG_DRAW_BITS + RNG_BOUNCE_BITS)
+
+// Blue-noise tiles are 2^RNG_TILE_BITS pixels wide.
+#define RNG_TILE_BITS 6
+
+// Jarzynski and Olano, "Hash Functions for GPU Rendering", 2020.
+// Only the first output of pcg2d is used.
+uint pcg2d(uint x, uint y) {
+	x = x * 1664525u + 1013904223u;
+	y = y * 1664525u + 1013904223u;
+
+	x += y * 1664525u;
+	y += x * 1664525u;
+	x ^= x >> 16u;
+	y ^= y >> 16u;
+
+	x += y * 1664525u;
+	x ^= x >> 16u;
+
+	return x;
+}
+
+#if defined(SAMPLER_SOBOL) || defined(SAMPLER_BLUE_NOISE)
+uint reverse_bits(uint x) {
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// Burley, "Practical Hash-based Owen Scrambling", 2020.
+uint nested_uniform_scramble(uint x, uint seed) {
+	x = reverse_bits(x);
+
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+
+	return reverse_bits(x);
+}
+
+// The first two Sobol dimensions, as 0.32 fixed point.
+uint sobol(uint index, uint dimension) {
+	if(dimension == 0) return reverse_bits(index);
+
+	uint x = 0;
+	for(uint v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+		if(index & 1) x ^= v;
+	}
+	return x;
+}
+
+// Two draws in a row make a 2D point. Every pair of dimensions gets its own
+// shuffle of the sequence and its own scramble, which keeps the pairs
+// independent of each other.
+uint sobol_next(uint index, uint key, uint draw) {
+	uint seed = pcg2d(key, draw >> 1);
+
+	index = nested_uniform_scramble(index, seed);
+	return nested_uniform_scramble(sobol(index, draw & 1), pcg2d(seed, draw & 1));
+}
+#endif
+
+#ifdef SAMPLER_BLUE_NOISE
+#if SAMPLER_SAMPLE_BITS + 2 * RNG_TILE_BITS > 32
+#error "Too many samples per pixel for SAMPLER_BLUE_NOISE"
+#endif
+
+uint morton_spread(uint x) {
+	x &= 0xffffu;
+	x = (x | (x << 8)) & 0x00ff00ffu;
+	x = (x | (x << 4)) & 0x0f0f0f0fu;
+	x = (x | (x << 2)) & 0x33333333u;
+	x = (x | (x << 1)) & 0x55555555u;
+	return x;
+}
+
+// Ahmed and Wonka, "Screen-Space Blue-Noise Diffusion of Monte Carlo Sampling
+// Error via Hierarchical Ordering of Pixels", 2020.
+// A pixel takes the samples at (Morton index in its tile) * samples per pixel.
+// The per-dimension shuffle in sobol_next scrambles that Morton order level by
+// level, so neighbouring pixels still share the strata of the sequence.
+uint2 rng_init(int2 pos, uint width, uint sample) {
+	const uint tile_mask = (1u << RNG_TILE_BITS) - 1;
+	uint tiles_x = (width + tile_mask) >> RNG_TILE_BITS;
+	uint tile = (pos.y >> RNG_TILE_BITS) * tiles_x + (pos.x >> RNG_TILE_BITS);
+
+	uint morton = morton_spread(pos.x & tile_mask) | (morton_spread(pos.y & tile_mask) << 1);
+	return (uint2)((morton << SAMPLER_SAMPLE_BITS) | sample, tile << RNG_SAMPLE_SHIFT);
+}
+#else
+uint2 rng_init(int2 pos, uint width, uint sample) {
+	return (uint2)(pos.x + width * pos.y, sample << RNG_SAMPLE_SHIFT);
+}
+#endif
+
+// Starts the draws of `bounce`, 0 is the camera ray.
+void rng_set_bounce(uint2* private seed, uint bounce) {
+	uint bounce_mask = ((1u << RNG_BOUNCE_BITS) - 1) << RNG_DRAW_BITS;
+	seed->y = (seed->y >> RNG_SAMPLE_SHIFT << RNG_SAMPLE_SHIFT) | ((bounce << RNG_DRAW_BITS) & bounce_mask);
+}
+
+// In [0, 1).
+float random_float(uint2* private seed) {
+	const uint dimension_mask = (1u << RNG_SAMPLE_SHIFT) - 1;
+
+#if defined(SAMPLER_SOBOL)
+	uint x = sobol_next((*seed).y >> RNG_SAMPLE_SHIFT, (*seed).x, (*seed).y & dimension_mask);
+#elif defined(SAMPLER_BLUE_NOISE)
+	uint x = sobol_next((*seed).x, (*seed).y >> RNG_SAMPLE_SHIFT, (*seed).y & dimension_mask);
+#else
+	uint x = pcg2d((*seed).x, (*seed).y);
+#endif
+	(*seed).y++;
+
+	return convert_float(x >> 8) * (1.0f / 16777216.0f);
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "host/CLKernel.h"
+#include "host/CLUtil.h"
+
+// Drives `kernels/adaptive_kernel.cl`. Every pass samples the active pixels,
+// then retires the ones whose noise is below the threshold and compacts the
+// rest into the next active list. Reading back the size of that list is the
+// only sync per pass, more samples per pass make it cheaper.
+//
+// The caller sets the scene arguments of `kernel()` (the same as test_kernel,
+// up to and including `camera`) and the BVH stats buffer at `statsIndex`.
+class AdaptiveSampler {
+  private:
+    cl_context context;
+    cl_command_queue queue;
+    cl_device_id device;
+
+    cl_program program;
+    cl_kernel render, retire;
+
+    cl_mem moments, activePixels[2], nextActiveCount;
+    uint pixelCount, activeCount;
+    int current = 0;
+    size_t samplesTaken = 0;
+
+    static constexpr size_t groupSize = 64;
+
+    cl_kernel createKernel(const char* name) {
+      cl_int err;
+      cl_kernel kernel = clCreateKernel(program, name, &err);
+      clErr(err);
+      return kernel;
+    }
+
+    cl_mem createScratch(size_t bytes) {
+      cl_int err;
+      cl_mem buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, nullptr, &err);
+      clErr(err);
+      return buffer;
+    }
+
+    void enqueue(cl_kernel kernel, uint count) {
+      size_t globalSize = (count + groupSize - 1) / groupSize * groupSize;
+      clErr(clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &globalSize, &groupSize, 0, nullptr, nullptr));
+    }
+
+  public:
+    static constexpr uint statsIndex = 15;
+
+    AdaptiveSampler(cl_context& context, cl_command_queue& queue, cl_device_id& device,
+                    const std::vector<std::string>& defines, cl_mem image, uint width, uint height,
+                    float threshold, int minSamples, int maxSamples)
+      : context(context), queue(queue), device(device), pixelCount(width * height), activeCount(width * height)
+    {
+      program = buildProgram("src/kernels/adaptive_kernel.cl", context, device, {"./src"}, defines);
+      render = createKernel("adaptive_kernel");
+      retire = createKernel("adaptive_retire");
+
+      moments         = createScratch(pixelCount * sizeof(float2));
+      activePixels[0] = createScratch(pixelCount * sizeof(uint));
+      activePixels[1] = createScratch(pixelCount * sizeof(uint));
+      nextActiveCount = createScratch(sizeof(uint));
+
+      const float2 zero = {};
+      clErr(clEnqueueFillBuffer(queue, moments, &zero, sizeof(zero), 0, pixelCount * sizeof(float2), 0, nullptr, nullptr));
+
+      // Everything starts active, in scanline order.
+      std::vector<uint> allPixels(pixelCount);
+      std::iota(allPixels.begin(), allPixels.end(), 0);
+      clErr(clEnqueueWriteBuffer(queue, activePixels[0], CL_TRUE, 0, pixelCount * sizeof(uint), allPixels.data(), 0, nullptr, nullptr));
+
+      kernelParameters(render, 14, moments);
+      kernelParameters(retire, 0, image, moments);
+      kernelParameters(retire, 6, threshold, minSamples, maxSamples);
+    }
+
+    ~AdaptiveSampler() {
+      clReleaseKernel(render);
+      clReleaseKernel(retire);
+      for(cl_mem m : {moments, activePixels[0], activePixels[1], nextActiveCount}) {
+        clReleaseMemObject(m);
+      }
+      clReleaseProgram(program);
+    }
+
+    AdaptiveSampler(const AdaptiveSampler&) = delete;
+    AdaptiveSampler& operator=(const AdaptiveSampler&) = delete;
+
+    cl_kernel kernel() { return render; }
+
+    uint active() const { return activeCount; }
+
+    // Samples actually traced so far, over all pixels.
+    size_t samples() const { return samplesTaken; }
+
+    // Gives every active pixel `samples` more samples, then retires the
+    // converged ones. Blocks until the new active count is known.
+    void pass(int samples) {
+      if(activeCount == 0) return;
+
+      const uint zero = 0;
+      clErr(clEnqueueFillBuffer(queue, nextActiveCount, &zero, sizeof(zero), 0, sizeof(zero), 0, nullptr, nullptr));
+
+      kernelParameters(render, 11, samples, activePixels[current], activeCount);
+      enqueue(render, activeCount);
+
+      kernelParameters(retire, 2, activePixels[current], activeCount, activePixels[1 - current], nextActiveCount);
+      enqueue(retire, activeCount);
+
+      samplesTaken += (size_t)activeCount * samples;
+
+      clErr(clEnqueueReadBuffer(queue, nextActiveCount, CL_TRUE, 0, sizeof(uint), &activeCount, 0, nullptr, nullptr));
+      current = 1 - current;
+    }
+};
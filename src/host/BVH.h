@@ -1,21 +1,122 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <queue>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "common/bvh_node.h"
 #include "common/sphere.h"
+#include "host/BVHStats.h"
+#include "host/TaskPool.h"
+
+enum class BVHSplitStrategy {
+	// Bins sphere centroids along each axis and only evaluates the planes
+	// between bins. Linear in the number of spheres per node.
+	BinnedSAH,
+	// Evaluates every sphere center on every axis as a candidate plane.
+	// Quadratic per node, kept as a reference to compare tree quality against.
+	SweepSAH
+};
+
+enum class BVHBuilder {
+	// Top-down binned/sweep SAH on the host, see `BVH`.
+	SAH,
+	// Morton code based linear BVH on the device, see `LBVH`.
+	LBVH
+};
+
+enum class BVHTraversal {
+	// Nearest child first, with a fixed size stack per ray.
+	Stack,
+	// Depth-first order with skip links, see `SkipLinkBVH`. No stack.
+	SkipLinks
+};
+
+enum class BVHLayout {
+	// Allocation order of the build. Siblings are adjacent, but subtrees
+	// end up scattered across the pool.
+	Build,
+	// Depth-first, the child with the larger surface area (the one more rays
+	// hit) first and its subtree right after it.
+	DepthFirst,
+	// Subtrees packed into 4 KiB blocks, grown from the largest nodes down.
+	// The blocks themselves are laid out depth-first.
+	Treelet
+};
+
+struct BVHBuildOptions {
+	BVHBuilder builder = BVHBuilder::SAH;
+	BVHSplitStrategy strategy = BVHSplitStrategy::BinnedSAH;
+	int binCount = 16;
+
+	// 1 builds on the calling thread only, 0 uses every hardware thread.
+	uint threadCount = 0;
+
+	// 2 traverses the binary tree as built. 4 and 8 collapse it into a wide
+	// tree (see `WideBVH`) and build the kernel for that node format.
+	int width = 2;
+
+	// Quantizes the wide nodes' child bounds, see `BVH4CompressedNode`.
+	// Only for width 4 and 8.
+	bool compressed = false;
+
+	// Only for width 2, the wide traversal always uses a stack.
+	BVHTraversal traversal = BVHTraversal::Stack;
+
+	// Node order in the pool, see `BVH::reorder()`.
+	BVHLayout layout = BVHLayout::Build;
+
+	// Where `SceneCache` keeps built trees. Empty disables it.
+	std::string cacheDirectory;
+
+	// Prints `BVHStats` after rendering, and writes them as JSON if a path
+	// is given. Builds the kernel with -DBVH_STATS for the traversal counters.
+	bool stats = false;
+	std::string statsJsonPath;
+};
 
 class BVH {
 	private:
 		BVHNode* pool = nullptr;
-		uint nodesUsed = 0;
+		std::atomic<uint> nodesUsed = 0;
 		std::vector<Sphere>& spheres;
+		BVHBuildOptions options;
+		// SAH cost right after the build, what `refit` compares against.
+		float builtCost = 0;
+
+		// Only set while building in parallel.
+		std::unique_ptr<TaskPool> taskPool;
 
 		const int rootNodeIndex = 0;
+
+		// Nodes with fewer spheres are built on the thread that split their
+		// parent. Spawning a task for small subtrees costs more than it saves.
+		static constexpr uint minParallelSubtree = 1024;
+
+		// Nodes with at least this many spheres get their binning split across
+		// the pool. Only matters near the root where there are few subtrees to
+		// hand out.
+		static constexpr uint minParallelBinning = 64 * 1024;
+		static constexpr uint binningChunkSize = 16 * 1024;
+
+		static constexpr uint layoutBlockSize = 4096;
+		static constexpr uint treeletPairs = layoutBlockSize / (2 * sizeof(BVHNode));
+
+		struct Bin {
+			AABB bounds;
+			uint sphereCount = 0;
+		};
+
 	public:
-		BVH(std::vector<Sphere>& spheres)
-			: spheres(spheres)
+		BVH(std::vector<Sphere>& spheres, BVHBuildOptions options = BVHBuildOptions())
+			: spheres(spheres), options(options)
 		{
+			auto start = std::chrono::high_resolution_clock::now();
+
 			// Tried 32, 64, 128, 256. All perform similarly on Vega 6.
 			pool = static_cast<BVHNode*>(aligned_alloc(64, sizeof(BVHNode) * 2 * spheres.size()));
 
@@ -28,27 +129,62 @@ class BVH {
 			root.sphere_count = spheres.size();
 			root.left_first = 0;
 
+			uint threadCount = options.threadCount;
+			if(threadCount == 0) threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+
+			if(threadCount > 1) {
+				taskPool = std::make_unique<TaskPool>(threadCount);
+			}
+
 			updateNodeBounds(rootNodeIndex);
 			subdivide(rootNodeIndex);
 
-			std::cout << "BVH built with " << nodesUsed << " Nodes.\n";
+			if(taskPool) {
+				taskPool->waitIdle();
+				taskPool.reset();
+			}
+
+			auto end = std::chrono::high_resolution_clock::now();
+			auto buildTime = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+
+			std::cout << "BVH built with " << nodesUsed << " Nodes in " << buildTime << " ms ("
+			          << (options.strategy == BVHSplitStrategy::SweepSAH ? "sweep SAH" : fmt("binned SAH, %d bins", options.binCount))
+			          << ", " << threadCount << (threadCount == 1 ? " thread" : " threads")
+			          << ").\n";
+
+			if(options.layout != BVHLayout::Build) {
+				float before = blocksPerPath();
+				start = std::chrono::high_resolution_clock::now();
+				reorder(options.layout);
+				end = std::chrono::high_resolution_clock::now();
+				auto reorderTime = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+
+				std::cout << fmt("BVH reordered %s in %.2f ms, a root to leaf walk touches %.2f %u byte blocks on average (was %.2f).\n",
+						options.layout == BVHLayout::DepthFirst ? "depth-first" : "into treelets",
+						reorderTime, blocksPerPath(), layoutBlockSize, before);
+			}
+
+			builtCost = sahCost();
 		}
 
 		~BVH() {
-			delete pool;
+			free(pool);
 		}
 
 		void updateNodeBounds(int node_index) {
 			assert(pool != nullptr);
 
 			BVHNode& node = pool[node_index];
-			node.bounds.x = node.bounds.y = node.bounds.z = interval_empty();
-
-			for(uint first = node.left_first, offset = 0; offset < node.sphere_count; offset++) {
-				const AABB& sb = spheres[first + offset].bbox;
-				AABB& nb = node.bounds;	
-				nb.grow(sb);
-			}
+			node.bounds = reduceSpheres<AABB>(node,
+				[this](uint first, uint count) {
+					AABB nb;
+					for(uint offset = 0; offset < count; offset++) {
+						const AABB& sb = spheres[first + offset].bbox;
+						nb.grow(sb);
+					}
+					return nb;
+				},
+				[](AABB& a, const AABB& b) { a.grow(b); });
 		}
 	
 		float evaluateSAH(BVHNode& node, int axis, float pos) {
@@ -68,21 +204,9 @@ class BVH {
 			return cost > 0 ? cost: infinity;
 		}
 
-		void subdivide(int node_index) {
-			BVHNode& node = pool[node_index];
-
-#if 0
-			if(node.sphere_count <= 4) return;
-			float3 extent = node.bounds.getExtent();
-
-			int axis = 0;
-			if(extent.s[1] > extent.s[0]) axis = 1;
-			if(extent.s[2] > extent.s[axis]) axis = 2;
-			float splitPos = node.bounds.axis(axis).min + extent.s[axis] * 0.5f;
-#else
-			int bestAxis = -1;
-			float parentCost = node.sphere_count * node.bounds.area();
-			float bestPos = 0, bestCost = infinity;
+		// Reference implementation, O(n^2) per node.
+		float findBestSplitPlaneSweep(BVHNode& node, int& bestAxis, float& bestPos) {
+			float bestCost = infinity;
 
 			for(int axis = 0; axis < 3; axis++) {
 				for(uint offset = 0; offset < node.sphere_count; offset++) {
@@ -93,11 +217,128 @@ class BVH {
 						bestPos = candidatePos, bestAxis = axis, bestCost = cost;
 				}
 			}
-			if(bestCost >= parentCost) return;
 
-			int axis = bestAxis;
-			float splitPos = bestPos;
-#endif
+			return bestCost;
+		}
+
+		// Runs `chunkFn(first, count)` over the spheres of `node` and folds the
+		// results with `merge`. Large nodes are split into chunks that run on the
+		// task pool. Everything we reduce (min/max, bounds, counts) gives the
+		// same result in any order, so the tree matches the serial build.
+		template<typename T, typename ChunkFn, typename MergeFn>
+		T reduceSpheres(const BVHNode& node, ChunkFn chunkFn, MergeFn merge) {
+			if(!taskPool || node.sphere_count < minParallelBinning) {
+				return chunkFn(node.left_first, node.sphere_count);
+			}
+
+			uint chunkCount = (node.sphere_count + binningChunkSize - 1) / binningChunkSize;
+			std::vector<T> partials(chunkCount);
+
+			taskPool->parallelFor(chunkCount, [&](uint chunk) {
+				uint first = chunk * binningChunkSize;
+				uint count = std::min(binningChunkSize, node.sphere_count - first);
+				partials[chunk] = chunkFn(node.left_first + first, count);
+			});
+
+			T result = std::move(partials[0]);
+			for(uint chunk = 1; chunk < chunkCount; chunk++) {
+				merge(result, partials[chunk]);
+			}
+			return result;
+		}
+
+		// https://jacco.ompf2.com/2022/04/21/how-to-build-a-bvh-part-3-quick-builds/
+		// Bins are laid over the bounds of the sphere centers rather than the node
+		// bounds, so big spheres (the ground) don't leave most bins empty.
+		float findBestSplitPlaneBinned(BVHNode& node, int& bestAxis, float& bestPos) {
+			const int binCount = options.binCount;
+			float bestCost = infinity;
+
+			// Centroid bounds, all three axes in one pass.
+			AABB centroidBounds = reduceSpheres<AABB>(node,
+				[this](uint first, uint count) {
+					AABB b;
+					for(uint i = first; i < first + count; i++) {
+						b.grow(AABB(spheres[i].center, spheres[i].center));
+					}
+					return b;
+				},
+				[](AABB& a, const AABB& b) { a.grow(b); });
+
+			float3 boundsMin = f3(centroidBounds.x.min, centroidBounds.y.min, centroidBounds.z.min);
+			float3 boundsMax = f3(centroidBounds.x.max, centroidBounds.y.max, centroidBounds.z.max);
+
+			// Bins of all three axes, stored as [axis * binCount + bin].
+			std::vector<Bin> allBins = reduceSpheres<std::vector<Bin>>(node,
+				[&](uint first, uint count) {
+					std::vector<Bin> b(3 * binCount);
+					for(int axis = 0; axis < 3; axis++) {
+						if(boundsMin.s[axis] == boundsMax.s[axis]) continue;
+
+						float scale = binCount / (boundsMax.s[axis] - boundsMin.s[axis]);
+						for(uint i = first; i < first + count; i++) {
+							int binIndex = std::min(binCount - 1, (int)((spheres[i].center.s[axis] - boundsMin.s[axis]) * scale));
+							b[axis * binCount + binIndex].sphereCount++;
+							b[axis * binCount + binIndex].bounds.grow(spheres[i].bbox);
+						}
+					}
+					return b;
+				},
+				[](std::vector<Bin>& a, const std::vector<Bin>& b) {
+					for(size_t i = 0; i < a.size(); i++) {
+						a[i].sphereCount += b[i].sphereCount;
+						a[i].bounds.grow(b[i].bounds);
+					}
+				});
+
+			std::vector<float> leftArea(binCount - 1), rightArea(binCount - 1);
+			std::vector<uint> leftCount(binCount - 1), rightCount(binCount - 1);
+
+			for(int axis = 0; axis < 3; axis++) {
+				float axisMin = boundsMin.s[axis], axisMax = boundsMax.s[axis];
+				if(axisMin == axisMax) continue;
+
+				const Bin* bins = &allBins[axis * binCount];
+
+				// Sweep once from each side to get the area and count of every split.
+				AABB leftBox, rightBox;
+				uint leftSum = 0, rightSum = 0;
+				for(int i = 0; i < binCount - 1; i++) {
+					leftSum += bins[i].sphereCount;
+					leftCount[i] = leftSum;
+					leftBox.grow(bins[i].bounds);
+					leftArea[i] = leftBox.area();
+
+					rightSum += bins[binCount - 1 - i].sphereCount;
+					rightCount[binCount - 2 - i] = rightSum;
+					rightBox.grow(bins[binCount - 1 - i].bounds);
+					rightArea[binCount - 2 - i] = rightBox.area();
+				}
+
+				float scale = (axisMax - axisMin) / binCount;
+				for(int i = 0; i < binCount - 1; i++) {
+					if(leftCount[i] == 0 || rightCount[i] == 0) continue;
+
+					float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+					if(cost < bestCost)
+						bestPos = axisMin + scale * (i + 1), bestAxis = axis, bestCost = cost;
+				}
+			}
+
+			return bestCost;
+		}
+
+		void subdivide(int node_index) {
+			BVHNode& node = pool[node_index];
+
+			int axis = -1;
+			float splitPos = 0;
+			float parentCost = node.sphere_count * node.bounds.area();
+			float splitCost = options.strategy == BVHSplitStrategy::SweepSAH
+				? findBestSplitPlaneSweep(node, axis, splitPos)
+				: findBestSplitPlaneBinned(node, axis, splitPos);
+
+			if(splitCost >= parentCost) return;
 
 			int i = node.left_first;
 			int j = i + node.sphere_count - 1;
@@ -112,8 +353,10 @@ class BVH {
 
 			uint left_count = i - node.left_first;
 			if(left_count == 0 || left_count == node.sphere_count) return;
-			int left_child_index = nodesUsed++;
-			int right_child_index = nodesUsed++;
+
+			// Siblings must stay next to each other, `bvh_intersect` relies on it.
+			int left_child_index = nodesUsed.fetch_add(2);
+			int right_child_index = left_child_index + 1;
 			pool[left_child_index].left_first = node.left_first;
 			pool[left_child_index].sphere_count = left_count;
 			pool[right_child_index].left_first = i;
@@ -125,10 +368,172 @@ class BVH {
 			updateNodeBounds(left_child_index);
 			updateNodeBounds(right_child_index);
 
-			subdivide(left_child_index);
+			// Hand the left subtree to the pool and keep going with the right one.
+			if(taskPool && left_count >= minParallelSubtree) {
+				taskPool->submit([this, left_child_index] { subdivide(left_child_index); });
+			} else {
+				subdivide(left_child_index);
+			}
 			subdivide(right_child_index);
 		}
 
+		// Rewrites the pool in the given order, keeping siblings adjacent and
+		// the root at 0. The hotter child of each pair goes first. Spheres are
+		// reordered so leaves appear in the same order as they do in the pool.
+		void reorder(BVHLayout layout) {
+			// Internal nodes, in the order their child pairs get placed.
+			std::vector<uint> order;
+			order.reserve(nodesUsed / 2);
+
+			auto hotFirst = [this](uint index) {
+				BVHNode& node = pool[index];
+				BVHNode& left = pool[node.left_first];
+				BVHNode& right = pool[node.left_first + 1];
+				if(right.bounds.area() > left.bounds.area()) std::swap(left, right);
+			};
+
+			std::vector<uint> roots;
+			if(pool[rootNodeIndex].sphere_count == 0) roots.push_back(rootNodeIndex);
+
+			while(!roots.empty()) {
+				uint root = roots.back();
+				roots.pop_back();
+
+				if(layout == BVHLayout::DepthFirst) {
+					hotFirst(root);
+					order.push_back(root);
+
+					const BVHNode& node = pool[root];
+					for(uint child : {node.left_first + 1, node.left_first}) {
+						if(pool[child].sphere_count == 0) roots.push_back(child);
+					}
+					continue;
+				}
+
+				// Grow a treelet from `root`, always opening the largest node.
+				auto smaller = [this](uint a, uint b) { return pool[a].bounds.area() < pool[b].bounds.area(); };
+				std::priority_queue<uint, std::vector<uint>, decltype(smaller)> frontier(smaller);
+				frontier.push(root);
+
+				for(uint pairs = 0; pairs < treeletPairs && !frontier.empty(); pairs++) {
+					uint index = frontier.top();
+					frontier.pop();
+					hotFirst(index);
+					order.push_back(index);
+
+					const BVHNode& node = pool[index];
+					for(uint child : {node.left_first, node.left_first + 1}) {
+						if(pool[child].sphere_count == 0) frontier.push(child);
+					}
+				}
+
+				// What's left starts new treelets, the largest one right after this one.
+				std::vector<uint> next;
+				for(; !frontier.empty(); frontier.pop()) next.push_back(frontier.top());
+				roots.insert(roots.end(), next.rbegin(), next.rend());
+			}
+
+			// Old index -> new index. Children are placed as a pair right where
+			// their parent comes up in `order`.
+			std::vector<uint> newIndex(nodesUsed);
+			newIndex[rootNodeIndex] = 0;
+			uint next = 1;
+			for(uint index : order) {
+				newIndex[pool[index].left_first] = next++;
+				newIndex[pool[index].left_first + 1] = next++;
+			}
+
+			BVHNode* reordered = static_cast<BVHNode*>(aligned_alloc(64, sizeof(BVHNode) * 2 * spheres.size()));
+			for(uint i = 0; i < nodesUsed; i++) {
+				BVHNode node = pool[i];
+				if(node.sphere_count == 0) node.left_first = newIndex[node.left_first];
+				reordered[newIndex[i]] = node;
+			}
+			free(pool);
+			pool = reordered;
+
+			std::vector<Sphere> sortedSpheres;
+			sortedSpheres.reserve(spheres.size());
+			for(uint i = 0; i < nodesUsed; i++) {
+				BVHNode& node = pool[i];
+				if(node.sphere_count == 0) continue;
+
+				uint first = sortedSpheres.size();
+				sortedSpheres.insert(sortedSpheres.end(), spheres.begin() + node.left_first, spheres.begin() + node.left_first + node.sphere_count);
+				node.left_first = first;
+			}
+			spheres.swap(sortedSpheres);
+		}
+
+		// Average number of `layoutBlockSize` blocks of the pool a root to leaf
+		// walk touches, weighted by leaf surface area (how likely rays are to
+		// get there). A rough proxy for cache and TLB misses per traversal.
+		float blocksPerPath() const {
+			auto block = [](uint index) { return index * sizeof(BVHNode) / layoutBlockSize; };
+
+			double blocks = 0, totalArea = 0;
+			std::vector<std::pair<uint, uint>> pending = { {rootNodeIndex, 1} };
+			while(!pending.empty()) {
+				auto [index, touched] = pending.back();
+				pending.pop_back();
+
+				const BVHNode& node = pool[index];
+				if(node.sphere_count > 0) {
+					blocks += touched * node.bounds.area();
+					totalArea += node.bounds.area();
+					continue;
+				}
+
+				for(uint child : {node.left_first, node.left_first + 1}) {
+					pending.emplace_back(child, touched + (block(child) != block(index)));
+				}
+			}
+			return totalArea > 0 ? blocks / totalArea : 1;
+		}
+
+		// Recomputes the bounds of every node from the spheres where they are
+		// now, keeping the topology. The host counterpart of `BVHRefitter`.
+		// Returns true when the tree got too slow to traverse compared to the
+		// build and should be built again.
+		bool refit(float rebuildThreshold = BVHStats::refitRebuildThreshold) {
+			// Parents come before their children in preorder, so going through
+			// it backwards refits the children first, whatever the layout.
+			std::vector<uint> order;
+			order.reserve(nodesUsed);
+			std::vector<uint> pending = { (uint)rootNodeIndex };
+			while(!pending.empty()) {
+				uint index = pending.back();
+				pending.pop_back();
+				order.push_back(index);
+
+				const BVHNode& node = pool[index];
+				if(node.sphere_count == 0) {
+					pending.push_back(node.left_first);
+					pending.push_back(node.left_first + 1);
+				}
+			}
+
+			for(auto it = order.rbegin(); it != order.rend(); it++) {
+				BVHNode& node = pool[*it];
+				if(node.sphere_count > 0) {
+					for(uint offset = 0; offset < node.sphere_count; offset++) {
+						spheres[node.left_first + offset].updateBBox();
+					}
+					updateNodeBounds(*it);
+				} else {
+					node.bounds = pool[node.left_first].bounds;
+					node.bounds.grow(pool[node.left_first + 1].bounds);
+				}
+			}
+
+			return sahCost() > builtCost * rebuildThreshold;
+		}
+
+		// SAH cost of the whole tree relative to the root's surface area.
+		float sahCost() const {
+			return BVHStats::computeSahCost(pool, nodesUsed);
+		}
+
 		BVHNode* getPool() const { return pool; }
-		const uint& getNodesUsed() const { return nodesUsed; }
+		uint getNodesUsed() const { return nodesUsed.load(); }
 };
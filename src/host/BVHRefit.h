@@ -0,0 +1,141 @@
+#pragma once
+
+#include <chrono>
+#include <vector>
+
+#include "common/bvh_node.h"
+#include "common/sphere.h"
+#include "host/BVHStats.h"
+#include "host/CLBuffer.h"
+#include "host/CLKernel.h"
+#include "host/CLUtil.h"
+
+// Refits a device-resident BVH after its spheres moved, without reading the
+// nodes back. Works on trees from both `BVH` and `LBVH`, see
+// `kernels/bvh_refit.cl`.
+//
+// Usage, per animation frame:
+// 	1. After a full build, call `setTree(nodes)`.
+// 	2. Update the device copy of the spheres (same order as the tree).
+// 	3. Call `refit(spheres, nodes)`. When it returns true the tree got too
+// 	   slow to traverse compared to the last full build: rebuild it and go to 1.
+class BVHRefitter {
+  private:
+    cl_context context;
+    cl_command_queue queue;
+
+    cl_program program;
+    cl_kernel computeParents, refitNodes, sahCostKernel;
+
+    cl_mem parents = nullptr, visits = nullptr;
+    uint nodeCount = 0;
+
+    float referenceCost = 0;
+    float rebuildThreshold;
+
+    static constexpr size_t sahGroupSize = 64;
+
+    cl_kernel createKernel(const char* name) {
+      cl_int err;
+      cl_kernel kernel = clCreateKernel(program, name, &err);
+      clErr(err);
+      return kernel;
+    }
+
+    void releaseScratch() {
+      if(parents != nullptr) clReleaseMemObject(parents);
+      if(visits != nullptr) clReleaseMemObject(visits);
+      parents = visits = nullptr;
+    }
+
+  public:
+    // rebuildThreshold: how much the SAH cost may grow, relative to the last
+    // full build, before `refit` asks for a rebuild.
+    BVHRefitter(cl_context& context, cl_command_queue& queue, cl_device_id& device,
+                float rebuildThreshold = BVHStats::refitRebuildThreshold)
+      : context(context), queue(queue), rebuildThreshold(rebuildThreshold)
+    {
+      program = buildProgram("src/kernels/bvh_refit.cl", context, device, {"./src"});
+
+      computeParents = createKernel("bvh_compute_parents");
+      refitNodes     = createKernel("bvh_refit");
+      sahCostKernel  = createKernel("bvh_sah_cost");
+    }
+
+    ~BVHRefitter() {
+      releaseScratch();
+      for(cl_kernel k : {computeParents, refitNodes, sahCostKernel}) {
+        clReleaseKernel(k);
+      }
+      clReleaseProgram(program);
+    }
+
+    BVHRefitter(const BVHRefitter&) = delete;
+    BVHRefitter& operator=(const BVHRefitter&) = delete;
+
+    // Must be called after every full build. Computes the parent links and
+    // remembers the tree's cost to compare refits against.
+    void setTree(CLBuffer<BVHNode>& nodes) {
+      releaseScratch();
+      nodeCount = nodes.count();
+
+      cl_int err;
+      parents = clCreateBuffer(context, CL_MEM_READ_WRITE, nodeCount * sizeof(uint), nullptr, &err);
+      clErr(err);
+      visits = clCreateBuffer(context, CL_MEM_READ_WRITE, nodeCount * sizeof(uint), nullptr, &err);
+      clErr(err);
+
+      kernelParameters(computeParents, 0, nodes, nodeCount, parents);
+      size_t globalSize = nodeCount;
+      clErr(clEnqueueNDRangeKernel(queue, computeParents, 1, nullptr, &globalSize, nullptr, 0, nullptr, nullptr));
+
+      referenceCost = sahCost(nodes);
+    }
+
+    // Returns true when the refitted tree's cost went past the threshold.
+    bool refit(CLBuffer<Sphere>& spheres, CLBuffer<BVHNode>& nodes) {
+      assert(parents != nullptr && "setTree must be called before refit");
+
+      auto start = std::chrono::high_resolution_clock::now();
+
+      const uint zero = 0;
+      clErr(clEnqueueFillBuffer(queue, visits, &zero, sizeof(zero), 0, nodeCount * sizeof(uint), 0, nullptr, nullptr));
+
+      kernelParameters(refitNodes, 0, spheres, nodes, nodeCount, parents, visits);
+      size_t globalSize = nodeCount;
+      clErr(clEnqueueNDRangeKernel(queue, refitNodes, 1, nullptr, &globalSize, nullptr, 0, nullptr, nullptr));
+
+      float cost = sahCost(nodes);
+
+      auto end = std::chrono::high_resolution_clock::now();
+      auto refitTime = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+      std::cout << fmt("BVH refitted in %.3f ms, SAH cost %.2f (%.2fx the last build).\n", refitTime, cost, cost / referenceCost);
+
+      return cost > referenceCost * rebuildThreshold;
+    }
+
+    // Reads back one float per work-group, not the nodes.
+    float sahCost(CLBuffer<BVHNode>& nodes) {
+      size_t groupCount = (nodeCount + sahGroupSize - 1) / sahGroupSize;
+      size_t globalSize = groupCount * sahGroupSize, localSize = sahGroupSize;
+
+      cl_int err;
+      cl_mem partials = clCreateBuffer(context, CL_MEM_READ_WRITE, groupCount * sizeof(float), nullptr, &err);
+      clErr(err);
+
+      kernelParameters(sahCostKernel, 0, nodes, nodeCount, partials);
+      clErr(clSetKernelArg(sahCostKernel, 3, sahGroupSize * sizeof(float), nullptr));
+      clErr(clEnqueueNDRangeKernel(queue, sahCostKernel, 1, nullptr, &globalSize, &localSize, 0, nullptr, nullptr));
+
+      std::vector<float> partialCosts(groupCount);
+      clErr(clEnqueueReadBuffer(queue, partials, CL_TRUE, 0, groupCount * sizeof(float), partialCosts.data(), 0, nullptr, nullptr));
+      clReleaseMemObject(partials);
+
+      AABB rootBounds;
+      clErr(clEnqueueReadBuffer(queue, nodes.devBuffer(), CL_TRUE, offsetof(BVHNode, bounds), sizeof(AABB), &rootBounds, 0, nullptr, nullptr));
+
+      float cost = 0;
+      for(float c : partialCosts) cost += c;
+      return cost / rootBounds.area();
+    }
+};
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "common/bvh_node.h"
+#include "common/bvh_stats.h"
+#include "host/CLUtil.h"
+
+// Quality of a binary BVH, computed from a host copy of its nodes, plus the
+// traversal counters of a kernel built with -DBVH_STATS.
+struct BVHStats {
+  uint nodeCount = 0, leafCount = 0, maxDepth = 0;
+  float sahCost = 0;
+
+  // [n] = number of leaves holding n spheres.
+  std::vector<uint> leafSizes;
+  // [d] = number of leaves at depth d, the root being at depth 0.
+  std::vector<uint> leafDepths;
+
+  bool hasCounters = false;
+  std::array<cl_ulong, BVH_STAT_COUNT> counters{};
+
+  // How far the SAH cost of a refitted tree may grow past its last full
+  // build before it should be rebuilt, see `BVH::refit` and `BVHRefitter`.
+  static constexpr float refitRebuildThreshold = 1.5f;
+
+  // SAH cost of the whole tree relative to the root's surface area. Node
+  // traversals and sphere tests are weighted the same.
+  static float computeSahCost(const BVHNode* nodes, uint count) {
+    float cost = 0;
+    for(uint i = 0; i < count; i++) {
+      const BVHNode& node = nodes[i];
+      cost += node.bounds.area() * (node.sphere_count > 0 ? node.sphere_count : 1);
+    }
+    return cost / nodes[0].bounds.area();
+  }
+
+  static BVHStats fromTree(const BVHNode* nodes, uint count) {
+    BVHStats stats;
+    stats.sahCost = computeSahCost(nodes, count);
+
+    // Iterative, so degenerate trees can't blow the call stack.
+    std::vector<std::pair<uint, uint>> pending = { {0, 0} };
+    while(!pending.empty()) {
+      auto [index, depth] = pending.back();
+      pending.pop_back();
+
+      stats.nodeCount++;
+      stats.maxDepth = std::max(stats.maxDepth, depth);
+
+      const BVHNode& node = nodes[index];
+      if(node.sphere_count > 0) {
+        stats.leafCount++;
+        if(stats.leafSizes.size() <= node.sphere_count) stats.leafSizes.resize(node.sphere_count + 1);
+        if(stats.leafDepths.size() <= depth) stats.leafDepths.resize(depth + 1);
+        stats.leafSizes[node.sphere_count]++;
+        stats.leafDepths[depth]++;
+      } else {
+        pending.emplace_back(node.left_first, depth + 1);
+        pending.emplace_back(node.left_first + 1, depth + 1);
+      }
+    }
+
+    return stats;
+  }
+
+  void print(std::ostream& out) const {
+    out << "BVH stats:\n"
+        << fmt("\tNodes: %u, leaves: %u, SAH cost: %.2f\n", nodeCount, leafCount, sahCost)
+        << fmt("\tMax depth: %u%s\n", maxDepth, maxDepth >= BVH_STACK_SIZE ? fmt(" (deeper than the %d entry traversal stack!)", BVH_STACK_SIZE).c_str() : "");
+
+    out << "\tLeaf sizes (spheres: leaves):";
+    for(size_t n = 0; n < leafSizes.size(); n++) {
+      if(leafSizes[n] > 0) out << fmt(" %zu: %u", n, leafSizes[n]);
+    }
+
+    out << "\n\tLeaf depths (depth: leaves):";
+    for(size_t d = 0; d < leafDepths.size(); d++) {
+      if(leafDepths[d] > 0) out << fmt(" %zu: %u", d, leafDepths[d]);
+    }
+    out << "\n";
+
+    if(hasCounters) {
+      double traversals = std::max<cl_ulong>(counters[BVH_STAT_TRAVERSALS], 1);
+      out << fmt("\tTraversals: %llu\n", (unsigned long long)counters[BVH_STAT_TRAVERSALS])
+          << fmt("\tPer traversal: %.2f node visits, %.2f box tests, %.2f sphere tests\n",
+                 counters[BVH_STAT_NODE_VISITS] / traversals,
+                 counters[BVH_STAT_BOX_TESTS] / traversals,
+                 counters[BVH_STAT_SPHERE_TESTS] / traversals)
+          << fmt("\tMost node visits in one traversal: %llu\n", (unsigned long long)counters[BVH_STAT_MAX_NODE_VISITS]);
+    }
+  }
+
+  bool writeJson(const std::string& path) const {
+    auto array = [](const std::vector<uint>& v) {
+      std::string s = "[";
+      for(size_t i = 0; i < v.size(); i++) s += fmt(i == 0 ? "%u" : ", %u", v[i]);
+      return s + "]";
+    };
+
+    std::ofstream out(path);
+    out << "{\n"
+        << fmt("  \"nodes\": %u,\n", nodeCount)
+        << fmt("  \"leaves\": %u,\n", leafCount)
+        << fmt("  \"sah_cost\": %f,\n", sahCost)
+        << fmt("  \"max_depth\": %u,\n", maxDepth)
+        << fmt("  \"stack_size\": %d,\n", BVH_STACK_SIZE)
+        << "  \"leaf_sizes\": " << array(leafSizes) << ",\n"
+        << "  \"leaf_depths\": " << array(leafDepths);
+
+    if(hasCounters) {
+      out << ",\n  \"traversal\": {\n"
+          << fmt("    \"traversals\": %llu,\n", (unsigned long long)counters[BVH_STAT_TRAVERSALS])
+          << fmt("    \"node_visits\": %llu,\n", (unsigned long long)counters[BVH_STAT_NODE_VISITS])
+          << fmt("    \"box_tests\": %llu,\n", (unsigned long long)counters[BVH_STAT_BOX_TESTS])
+          << fmt("    \"sphere_tests\": %llu,\n", (unsigned long long)counters[BVH_STAT_SPHERE_TESTS])
+          << fmt("    \"max_node_visits\": %llu\n", (unsigned long long)counters[BVH_STAT_MAX_NODE_VISITS])
+          << "  }";
+    }
+    out << "\n}\n";
+
+    return (bool)out;
+  }
+};
@@ -35,6 +35,19 @@ class CLBuffer {
       return ret;
     }
 
+    // Uploads `count` elements straight from `ptr`, e.g. a mapped file,
+    // without a host copy. Only the device copy and `count()` are there.
+    static CLBuffer<T> fromDevicePtr(cl_context& ctx, cl_command_queue& q, const T* ptr, size_t count) {
+      CLBuffer<T> ret(ctx, q, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 0);
+
+      cl_int err;
+      ret.deviceBuffer = clCreateBuffer(ctx, ret.flags, count * sizeof(T), (void*)ptr, &err);
+      clErr(err);
+      ret.deviceOnlyCount = count;
+
+      return ret;
+    }
+
     // Named to match `std::vector` naming.
     CLBuffer& push_back(T e) {
       hostBuffer.push_back(e);
@@ -60,26 +73,52 @@ class CLBuffer {
       return hostBuffer.end();
     }
 
-    void uploadToDevice(cl_context& ctx) {
+    // Aborts on errors, unless `status` takes them.
+    void uploadToDevice(cl_context& ctx, cl_int* status = nullptr) {
       /* if(hostBuffer.data() == nullptr) return; */
 
       cl_int err;
       deviceBuffer = clCreateBuffer(ctx, flags | CL_MEM_COPY_HOST_PTR, hostBuffer.size() * sizeof(T), hostBuffer.data(), &err);
+      clErrOr(err, status);
+    }
+
+    // For buffers that are filled in by kernels. Sizes the host side to
+    // `count` elements so `count()` and `readFromDevice()` work, but doesn't
+    // upload anything.
+    void allocateOnDevice(cl_context& ctx, size_t count) {
+      hostBuffer.resize(count);
+
+      cl_int err;
+      deviceBuffer = clCreateBuffer(ctx, flags & ~CL_MEM_COPY_HOST_PTR, count * sizeof(T), nullptr, &err);
       clErr(err);
     }
 
+    // Frees the device copy. CLBuffer doesn't on its own, this is for the
+    // ones that get uploaded again.
+    void releaseDevice() {
+      if(deviceBuffer != nullptr) clReleaseMemObject(deviceBuffer);
+      deviceBuffer = nullptr;
+    }
+
+    // Copies the host side over the device copy, which must be as big.
+    void writeToDevice() {
+      clErr(clEnqueueWriteBuffer(queue, deviceBuffer, CL_TRUE, 0, hostBuffer.size() * sizeof(T), hostBuffer.data(), 0, NULL, NULL));
+    }
+
     void readFromDevice() {
       clErr(clEnqueueReadBuffer(queue, deviceBuffer, CL_TRUE, 0, hostBuffer.size() * sizeof(T), hostBuffer.data(), 0, NULL, NULL));
     }
 
     const cl_mem& devBuffer() const { return deviceBuffer; }
-    const uint& count() { elementCount = hostBuffer.size(); return elementCount; }
+    const uint& count() { elementCount = hostBuffer.empty() ? deviceOnlyCount : hostBuffer.size(); return elementCount; }
 
   private:
     std::vector<T> hostBuffer;
-    cl_mem deviceBuffer;
+    cl_mem deviceBuffer = nullptr;
     cl_command_queue queue;
     cl_mem_flags flags;
+    // Elements of a buffer from `fromDevicePtr`, which has no host side.
+    size_t deviceOnlyCount = 0;
 
     // Needed since OpenCL needs to have the address of an existing variable for
     // uploading the data. (i.e the variable needs to outlive the kernel call).
@@ -105,3 +105,7 @@ inline void checkErr(cl_int err, const char *name) {
 }
 
 #define clErr(err) checkErr(err, ("FILE: " + std::string(__FILE__) + ", LINE: " + std::to_string(__LINE__)).c_str())
+
+// For callers that can handle the error: hands it to `status`, or checks it
+// like clErr if that's null.
+#define clErrOr(err, status) ((status) != nullptr ? (void)(*(status) = (err)) : clErr(err))
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "CLUtil.h"
+#include "CLBuffer.h"
 
 // Borrowed from https://github.com/ProjectPhysX/OpenCL-Wrapper/blob/master/src/opencl.hpp
 
@@ -1,8 +1,10 @@
 #include "host/CLUtil.h"
+#include "host/ProgramCache.h"
 #include "host/Utils.h"
 
 #include <CL/cl.h>
 #include <algorithm>
+#include <chrono>
 #include <filesystem>
 #include <iomanip>
 #include <iterator>
@@ -177,7 +179,7 @@ auto loadKernel(string path) -> string {
   return string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
 }
 
-auto buildClCompileFlags(const vector<string>& includes) -> string {
+auto buildClCompileFlags(const vector<string>& includes, const vector<string>& defines) -> string {
   std::stringstream s;
 
   s << "-DOPENCL -cl-std=CL2.0 ";
@@ -192,6 +194,10 @@ auto buildClCompileFlags(const vector<string>& includes) -> string {
     s << fmt("-I%s ", include.c_str());
   }
 
+  for (const auto& define : defines) {
+    s << fmt("-D%s ", define.c_str());
+  }
+
   std::cout << "Kernel compilation flags: " << std::quoted(s.str()) << std::endl;
   return s.str();
 }
@@ -200,9 +206,30 @@ auto buildProgram(
     string kernelFile,
     cl_context &context,
     cl_device_id& device,
-    const vector<string>& includes
+    const vector<string>& includes,
+    const vector<string>& defines
 ) -> cl_program
 {
+  string flags = buildClCompileFlags(includes, defines);
+  auto start = std::chrono::high_resolution_clock::now();
+  auto elapsedMs = [&] {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() / 1000.0;
+  };
+
+  std::optional<ProgramCache> cache;
+  if(ProgramCache::enabled()) {
+    string deviceId = getClInfo<std::string>(device, CL_DEVICE_NAME) + '\n' + getClInfo<std::string>(device, CL_DRIVER_VERSION);
+    cache.emplace(kernelFile, includes, flags, deviceId);
+
+    double buildMs;
+    if(auto program = cache->load(context, device, flags, buildMs)) {
+      double loadMs = elapsedMs();
+      cout << fmt("Loaded %s from the program cache in %.0f ms, building took %.0f ms (%.0f ms saved)\n",
+                  kernelFile.c_str(), loadMs, buildMs, buildMs - loadMs);
+      return *program;
+    }
+  }
+
   string kernelSource = loadKernel(kernelFile);
 
   int err;
@@ -211,8 +238,6 @@ auto buildProgram(
   cl_program program = clCreateProgramWithSource(context, 1, sources, sizes, &err);
   clErr(err);
 
-  string flags = buildClCompileFlags(includes);
-
   err = clBuildProgram(program, 1, &device, flags.c_str(), NULL, NULL);
 
   if (err == CL_BUILD_PROGRAM_FAILURE || err == CL_INVALID_PROGRAM) {
@@ -228,6 +253,8 @@ auto buildProgram(
 
     cerr << fmt("Build log for: %s\n", name.c_str());
     cerr << buildlog;
+  } else if(err == CL_SUCCESS && cache) {
+    cache->store(program, elapsedMs());
   }
 
   return program;
@@ -238,10 +265,11 @@ auto kernelFromFile(
     std::string kernelPath,
     cl_context& context,
     cl_device_id& device,
-    std::vector<std::string> includes
+    std::vector<std::string> includes,
+    std::vector<std::string> defines
 ) -> cl_kernel
 {
-  cl_program test_program = buildProgram(kernelPath, context, device, includes);
+  cl_program test_program = buildProgram(kernelPath, context, device, includes, defines);
 
   std::filesystem::path filepath(kernelPath);
   
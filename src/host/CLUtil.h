@@ -3,10 +3,19 @@
 #include "./CLErrors.h"
 #include <vector>
 
+#define float2  cl_float2
 #define float3  cl_float3
+#define float4  cl_float4
+#define float8  cl_float8
 #define float   cl_float
 #define uint    cl_uint
 #define uint2   cl_uint2
+#define uint4   cl_uint4
+#define uint8   cl_uint8
+#define uchar4  cl_uchar4
+#define uchar8  cl_uchar8
+#define ushort4 cl_ushort4
+#define ushort8 cl_ushort8
 #define int2    cl_int2
 #define u8      uint8_t 
 #define float16 cl_float16
@@ -22,7 +31,9 @@
 #include <utility>
 
 auto setupCL() -> std::tuple<cl_context, cl_command_queue, cl_device_id>; 
-auto kernelFromFile( std::string kernelPath, cl_context& context, cl_device_id& devices, std::vector<std::string> includes = std::vector<std::string>()) -> cl_kernel;
+// `defines` are passed as "-D<define>", e.g. {"BVH_WIDTH=4"}.
+auto buildProgram(std::string kernelFile, cl_context &context, cl_device_id& device, const std::vector<std::string>& includes, const std::vector<std::string>& defines = {}) -> cl_program;
+auto kernelFromFile( std::string kernelPath, cl_context& context, cl_device_id& devices, std::vector<std::string> includes = std::vector<std::string>(), std::vector<std::string> defines = std::vector<std::string>()) -> cl_kernel;
 
 #define MATERIAL_DEF(Type, TypeTag, EqualityOpDef)                     \
   public:                                                              \
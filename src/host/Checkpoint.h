@@ -0,0 +1,264 @@
+#pragma once
+
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "common/camera.h"
+#include "host/CLUtil.h"
+#include "host/Hash.h"
+#include "host/SceneCache.h"
+#include "host/Utils.h"
+
+// Saves the accumulation image of a long render every so often, so a crashed
+// or preempted render can go on from the last checkpoint with --resume.
+//
+// Alpha counts the samples of every pixel, and the kernels key their random
+// numbers by it (see device/sampler.h). So the image is all the state there
+// is, a resumed render takes exactly the samples the uninterrupted one would
+// have.
+//
+// Snapshots are copied on the device and read back on a queue of their own,
+// and a thread writes them to disk. The render only waits for the copy.
+//
+// A render of `--sample-range` leaves one as its result, for sample_merge.
+// Such an image only sums the samples from `firstSample` on, but alpha still
+// numbers them from 0.
+//
+// File layout: `Header`, then the RGBA float image.
+class Checkpoint {
+  private:
+    struct Header {
+      char magic[8];
+      uint64_t key;
+      uint32_t width, height;
+      // The image sums samples [firstSample, samples) of every pixel.
+      uint32_t firstSample, samples;
+      uint32_t pixelSize, reserved;
+    };
+
+    static constexpr char magic[8] = "CRTCKP2";
+
+    cl_command_queue queue;
+    cl_mem image, snapshot;
+    uint width, height;
+    uint64_t key;
+    int firstSample;
+    std::filesystem::path path;
+
+    // Where the snapshot is read back to, owned by the writer while it's busy.
+    std::vector<float> pixels;
+
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    cl_event pending = nullptr;
+    int pendingSamples = 0;
+    bool writing = false, stopping = false;
+    int written = 0;
+
+    size_t bytes() const { return (size_t)width * height * 4 * sizeof(float); }
+
+    // Written next to the final file and renamed, so a crash while writing
+    // leaves the previous checkpoint in place.
+    bool store(int samples) {
+      Header h = {};
+      std::copy(magic, magic + sizeof(magic), h.magic);
+      h.key = key;
+      h.width = width;
+      h.height = height;
+      h.firstSample = firstSample;
+      h.samples = samples;
+      h.pixelSize = 4 * sizeof(float);
+
+      std::filesystem::path tmpPath = path;
+      tmpPath += fmt(".%d.tmp", getpid());
+
+      std::ofstream out(tmpPath, std::ios::binary);
+      out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+      out.write(reinterpret_cast<const char*>(pixels.data()), bytes());
+      out.close();
+
+      std::error_code err;
+      if(out) std::filesystem::rename(tmpPath, path, err);
+      if(!out || err) {
+        std::cerr << fmt("\nCouldn't write the checkpoint to %s.\n", path.c_str());
+        std::filesystem::remove(tmpPath, err);
+        return false;
+      }
+      return true;
+    }
+
+    void run() {
+      std::unique_lock lock(mutex);
+      while(true) {
+        wake.wait(lock, [&] { return pending || stopping; });
+        if(!pending) return;
+
+        cl_event read = pending;
+        int samples = pendingSamples;
+        pending = nullptr;
+
+        lock.unlock();
+        clErr(clWaitForEvents(1, &read));
+        clReleaseEvent(read);
+        bool ok = store(samples);
+        lock.lock();
+
+        written += ok;
+        writing = false;
+        done.notify_all();
+      }
+    }
+
+  public:
+    // A checkpoint read back by `load`.
+    struct Saved {
+      uint64_t key;
+      uint width, height;
+      int firstSample, samples;
+      // RGBA, alpha counts the samples.
+      std::vector<float> pixels;
+    };
+
+    // Everything that changes what the samples add up to. The BVH defines only
+    // change how the hits are found, so a render may resume with other BVH
+    // options. Hashes the scene, so call it before building reorders the
+    // spheres.
+    static uint64_t sceneKey(const Camera& camera, int width, int height, int maxDepth, const std::vector<std::string>& defines) {
+      Hash hash;
+      SceneCache::addScene(hash);
+
+      SceneCache::addFloat3(hash, camera.lookfrom);
+      SceneCache::addFloat3(hash, camera.lookat);
+      SceneCache::addFloat3(hash, camera.vup);
+      hash.add(camera.vfov).add(camera.aperature).add(camera.focus_dist);
+
+      hash.add(width).add(height).add(maxDepth);
+      for(const std::string& define : defines) {
+        if(define.rfind("BVH_", 0) != 0) hash.add(define);
+      }
+
+      return hash.get();
+    }
+
+    // Reports why, and returns nothing, if the file is missing or damaged.
+    static std::optional<Saved> read(const std::filesystem::path& path) {
+      std::ifstream in(path, std::ios::binary);
+      if(!in) {
+        std::cerr << fmt("Couldn't open the checkpoint %s.\n", path.c_str());
+        return std::nullopt;
+      }
+
+      Header h;
+      in.read(reinterpret_cast<char*>(&h), sizeof(h));
+      if(!in || !std::equal(magic, magic + sizeof(magic), h.magic) || h.pixelSize != 4 * sizeof(float)) {
+        std::cerr << fmt("%s is not a checkpoint.\n", path.c_str());
+        return std::nullopt;
+      }
+
+      Saved saved{h.key, h.width, h.height, (int)h.firstSample, (int)h.samples, std::vector<float>((size_t)h.width * h.height * 4)};
+      in.read(reinterpret_cast<char*>(saved.pixels.data()), saved.pixels.size() * sizeof(float));
+      if(!in) {
+        std::cerr << fmt("The checkpoint %s is truncated.\n", path.c_str());
+        return std::nullopt;
+      }
+
+      return saved;
+    }
+
+    // Same as `read`, and also fails if the file is from another scene or
+    // configuration.
+    static std::optional<Saved> load(const std::filesystem::path& path, uint64_t key, uint width, uint height) {
+      auto saved = read(path);
+      if(saved && (saved->key != key || saved->width != width || saved->height != height)) {
+        std::cerr << fmt("The checkpoint %s is of another scene or configuration.\n", path.c_str());
+        return std::nullopt;
+      }
+      return saved;
+    }
+
+    // `firstSample` is the start of the sample range the image sums.
+    Checkpoint(cl_context& context, cl_device_id& device, cl_mem image, uint width, uint height, uint64_t key,
+               int firstSample, const std::filesystem::path& path)
+      : image(image), width(width), height(height), key(key), firstSample(firstSample), path(path),
+        pixels((size_t)width * height * 4)
+    {
+      cl_int err;
+      queue = clCreateCommandQueueWithProperties(context, device, NULL, &err);
+      clErr(err);
+      snapshot = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes(), nullptr, &err);
+      clErr(err);
+
+      writer = std::thread([this] { run(); });
+    }
+
+    // Waits for the last checkpoint to be written.
+    ~Checkpoint() {
+      {
+        std::lock_guard lock(mutex);
+        stopping = true;
+      }
+      wake.notify_one();
+      writer.join();
+
+      clReleaseMemObject(snapshot);
+      clReleaseCommandQueue(queue);
+    }
+
+    Checkpoint(const Checkpoint&) = delete;
+    Checkpoint& operator=(const Checkpoint&) = delete;
+
+    // Still writing the last one. A new one can't start until it's done.
+    bool busy() {
+      std::lock_guard lock(mutex);
+      return writing;
+    }
+
+    void wait() {
+      std::unique_lock lock(mutex);
+      done.wait(lock, [&] { return !writing; });
+    }
+
+    // Checkpoints written so far.
+    int count() {
+      std::lock_guard lock(mutex);
+      return written;
+    }
+
+    const std::filesystem::path& file() const { return path; }
+
+    // Snapshots the image once `after` completes, every pixel having
+    // `samples` samples by then, and writes it out in the background. Only
+    // when not `busy`. A null `after` copies right away, for once the render
+    // is finished. Returns the event of the copy, the render must not touch the
+    // image before it completes. The caller releases it.
+    cl_event save(cl_event after, int samples) {
+      const std::array<size_t, 3> origin = {0, 0, 0};
+      const std::array<size_t, 3> region = {width, height, 1};
+
+      cl_event copied, read;
+      clErr(clEnqueueCopyImageToBuffer(queue, image, snapshot, origin.data(), region.data(), 0, after ? 1 : 0, after ? &after : nullptr, &copied));
+      clErr(clEnqueueReadBuffer(queue, snapshot, CL_FALSE, 0, bytes(), pixels.data(), 1, &copied, &read));
+      clErr(clFlush(queue));
+
+      {
+        std::lock_guard lock(mutex);
+        pending = read;
+        pendingSamples = samples;
+        writing = true;
+      }
+      wake.notify_one();
+
+      return copied;
+    }
+};
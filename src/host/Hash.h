@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+// 64 bit FNV-1a. Good enough to tell inputs apart for caching, not meant to
+// hold up against anyone crafting collisions.
+class Hash {
+  public:
+    Hash& bytes(const void* data, size_t size) {
+      const uint8_t* p = static_cast<const uint8_t*>(data);
+      for(size_t i = 0; i < size; i++) {
+        value = (value ^ p[i]) * 0x100000001b3ull;
+      }
+      return *this;
+    }
+
+    // Only for types without padding, padding bytes aren't guaranteed to be
+    // the same between two otherwise equal values.
+    template<typename T>
+    Hash& add(const T& v) { return bytes(&v, sizeof(T)); }
+
+    Hash& add(const std::string& s) { return add(s.size()).bytes(s.data(), s.size()); }
+
+    uint64_t get() const { return value; }
+
+    std::string hex() const {
+      char buf[17];
+      std::snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)value);
+      return buf;
+    }
+
+  private:
+    uint64_t value = 0xcbf29ce484222325ull;
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include "host/CLKernel.h"
+#include "host/CLUtil.h"
+#include "host/Utils.h"
+
+// Drives `kernels/resolve.cl`. Resolves the float accumulation image into
+// 8-bit pixels on the device and reads back only those, a quarter of the
+// bytes of the float image for RGBA8 and less for RGB8.
+//
+// Errors of the device abort, unless the call has a `status` to take them.
+class ImageResolve {
+  private:
+    cl_command_queue queue;
+    cl_kernel kernel;
+    cl_mem pixels;
+    uint width, height;
+    int channels;
+
+  public:
+    // `channels` is 3 for RGB8 or 4 for RGBA8.
+    ImageResolve(cl_context& context, cl_command_queue& queue, cl_device_id& device, cl_mem image,
+                 uint width, uint height, int channels = 3, cl_int* status = nullptr)
+      : queue(queue), pixels(nullptr), width(0), height(0), channels(channels)
+    {
+      kernel = kernelFromFile("src/kernels/resolve.cl", context, device, {"./src"});
+      kernelParameters(kernel, 3, channels);
+
+      setImage(context, image, width, height, status);
+    }
+
+    // Resolves another image from now on, without building the kernel again.
+    // If that fails the next call tries again.
+    void setImage(cl_context& context, cl_mem image, uint width, uint height, cl_int* status = nullptr) {
+      if(pixels == nullptr || width * height != this->width * this->height) {
+        if(pixels != nullptr) clReleaseMemObject(pixels);
+
+        cl_int err;
+        pixels = clCreateBuffer(context, CL_MEM_WRITE_ONLY, (size_t)width * height * channels, nullptr, &err);
+        clErrOr(err, status);
+        if(err != CL_SUCCESS) {
+          pixels = nullptr;
+          return;
+        }
+      }
+      this->width = width;
+      this->height = height;
+
+      kernelParameters(kernel, 0, image, pixels);
+    }
+
+    ~ImageResolve() {
+      clReleaseKernel(kernel);
+      if(pixels != nullptr) clReleaseMemObject(pixels);
+    }
+
+    ImageResolve(const ImageResolve&) = delete;
+    ImageResolve& operator=(const ImageResolve&) = delete;
+
+    // A samplesPerPixel of 0 divides each pixel by its own sample count.
+    std::vector<u8> resolve(int samplesPerPixel, cl_int* status = nullptr) {
+      kernelParameters(kernel, 2, samplesPerPixel);
+
+      const std::array<size_t, 2> localSize{16, 16};
+      const std::array<size_t, 2> globalSize{(width + 15) / 16 * 16, (height + 15) / 16 * 16};
+      cl_int err = clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, globalSize.data(), localSize.data(), 0, nullptr, nullptr);
+
+      std::vector<u8> result((size_t)width * height * channels);
+      if(err == CL_SUCCESS) err = clEnqueueReadBuffer(queue, pixels, CL_TRUE, 0, result.size(), result.data(), 0, nullptr, nullptr);
+      clErrOr(err, status);
+      return result;
+    }
+};
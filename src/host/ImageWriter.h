@@ -0,0 +1,527 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "host/CLUtil.h"
+#include "host/TaskPool.h"
+#include "host/Utils.h"
+
+enum class ImageFormat {
+  // ASCII P3, what CRT used to write.
+  PPMText,
+  // Binary P6.
+  PPM,
+  // Portable float map, linear RGB.
+  PFM,
+  PNG,
+  // Uncompressed scanline OpenEXR, linear 32-bit float RGB.
+  EXR
+};
+
+inline const char* imageFormatName(ImageFormat format) {
+  switch(format) {
+    case ImageFormat::PPMText: return "p3";
+    case ImageFormat::PFM:     return "pfm";
+    case ImageFormat::PNG:     return "png";
+    case ImageFormat::EXR:     return "exr";
+    default:                   return "ppm";
+  }
+}
+
+inline std::optional<ImageFormat> imageFormatFromName(std::string name) {
+  std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+  for(ImageFormat format : {ImageFormat::PPMText, ImageFormat::PPM, ImageFormat::PFM, ImageFormat::PNG, ImageFormat::EXR}) {
+    if(name == imageFormatName(format)) return format;
+  }
+  return std::nullopt;
+}
+
+// From the extension, binary PPM if it's unknown.
+inline ImageFormat imageFormatFromPath(const std::filesystem::path& path) {
+  std::string extension = path.extension().string();
+  if(!extension.empty()) extension.erase(0, 1);
+  return imageFormatFromName(extension).value_or(ImageFormat::PPM);
+}
+
+// PFM and EXR keep the linear radiance, the others take gamma-corrected 8-bit pixels.
+inline bool imageFormatIsHdr(ImageFormat format) {
+  return format == ImageFormat::PFM || format == ImageFormat::EXR;
+}
+
+// Encodes and writes the output image. 8-bit formats take the RGB8 pixels of
+// `ImageResolve`, HDR formats the float accumulation image, which gets
+// divided by the sample count here.
+// The rows are converted and encoded in blocks on a TaskPool, each block into
+// its own buffer, and the whole file goes out with one fwrite.
+class ImageWriter {
+  private:
+    uint width, height;
+    TaskPool pool;
+
+    static constexpr uint rowsPerBlock = 32;
+
+    using Bytes = std::vector<u8>;
+
+    // Calls encode(firstRow, endRow, out) for every block of rows in
+    // parallel, and appends the blocks to `file` in order.
+    void encodeRows(Bytes& file, const std::function<void(uint, uint, Bytes&)>& encode) {
+      uint blockCount = (height + rowsPerBlock - 1) / rowsPerBlock;
+      std::vector<Bytes> blocks(blockCount);
+
+      pool.parallelFor(blockCount, [&](uint block) {
+        uint firstRow = block * rowsPerBlock;
+        encode(firstRow, std::min(firstRow + rowsPerBlock, height), blocks[block]);
+      });
+
+      size_t size = file.size();
+      for(const Bytes& block : blocks) size += block.size();
+      file.reserve(size);
+      for(const Bytes& block : blocks) file.insert(file.end(), block.begin(), block.end());
+    }
+
+    static void append(Bytes& out, const void* data, size_t size) {
+      const u8* bytes = (const u8*)data;
+      out.insert(out.end(), bytes, bytes + size);
+    }
+
+    static void append(Bytes& out, const std::string& s) {
+      append(out, s.data(), s.size());
+    }
+
+    template<class T> static void appendLE(Bytes& out, T value) {
+      // The hosts we run on are little-endian.
+      append(out, &value, sizeof(T));
+    }
+
+    static void appendBE32(Bytes& out, uint32_t value) {
+      for(int shift = 24; shift >= 0; shift -= 8) out.push_back((value >> shift) & 0xff);
+    }
+
+    static bool writeFile(const std::filesystem::path& path, const Bytes& file) {
+      FILE* f = fopen(path.c_str(), "wb");
+      if(f == NULL) {
+        fprintf(stderr, "Failed to open file at %s for writing\n", path.c_str());
+        return false;
+      }
+
+      bool ok = fwrite(file.data(), 1, file.size(), f) == file.size();
+      ok = fclose(f) == 0 && ok;
+      if(!ok) fprintf(stderr, "Failed to write %s\n", path.c_str());
+      return ok;
+    }
+
+    // Linear RGB of a pixel of the accumulation image.
+    static std::array<float, 3> linear(const float* rgba, size_t pixel, int samplesPerPixel) {
+      const float* p = rgba + 4 * pixel;
+      float scale = 1.0f / (samplesPerPixel > 0 ? samplesPerPixel : std::max(p[3], 1.0f));
+      return {p[0] * scale, p[1] * scale, p[2] * scale};
+    }
+
+    // PNG ---------------------------------------------------------------------
+
+    static uint32_t crc32(const u8* data, size_t size, uint32_t crc = 0) {
+      static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t;
+        for(uint32_t n = 0; n < 256; n++) {
+          uint32_t c = n;
+          for(int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+          t[n] = c;
+        }
+        return t;
+      }();
+
+      crc = ~crc;
+      for(size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+      return ~crc;
+    }
+
+    static uint32_t adler32(const u8* data, size_t size) {
+      uint32_t a = 1, b = 0;
+      while(size > 0) {
+        // Largest run that can't overflow before the modulo.
+        size_t run = std::min<size_t>(size, 5552);
+        for(size_t i = 0; i < run; i++) {
+          a += data[i];
+          b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += run;
+        size -= run;
+      }
+      return (b << 16) | a;
+    }
+
+    static void appendPngChunk(Bytes& out, const char* type, const Bytes& data) {
+      appendBE32(out, data.size());
+      size_t start = out.size();
+      append(out, type, 4);
+      append(out, data.data(), data.size());
+      appendBE32(out, crc32(out.data() + start, out.size() - start));
+    }
+
+    static u8 paeth(int a, int b, int c) {
+      int p = a + b - c;
+      int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+      if(pa <= pb && pa <= pc) return a;
+      return pb <= pc ? b : c;
+    }
+
+    // Applies PNG filter `type` to a row, `above` is null on the first row.
+    static void applyFilter(uint type, const u8* row, const u8* above, uint rowSize, u8* out) {
+      if(!above) {
+        // Up is None and Paeth is Sub without a row above.
+        if(type == 2) type = 0;
+        if(type == 4) type = 1;
+      }
+
+      switch(type) {
+        case 0:
+          memcpy(out, row, rowSize);
+          break;
+        case 1:
+          for(uint i = 0; i < rowSize; i++) out[i] = row[i] - (i >= 3 ? row[i - 3] : 0);
+          break;
+        case 2:
+          for(uint i = 0; i < rowSize; i++) out[i] = row[i] - above[i];
+          break;
+        case 3:
+          for(uint i = 0; i < rowSize; i++) {
+            int a = i >= 3 ? row[i - 3] : 0;
+            int b = above ? above[i] : 0;
+            out[i] = row[i] - (a + b) / 2;
+          }
+          break;
+        default:
+          for(uint i = 0; i < 3; i++) out[i] = row[i] - above[i];
+          for(uint i = 3; i < rowSize; i++) out[i] = row[i] - paeth(row[i - 3], above[i], above[i - 3]);
+          break;
+      }
+    }
+
+    // Filters a row with whichever PNG filter gives the smallest sum of
+    // absolute differences, the usual heuristic. `out` gets the filter type
+    // byte and the filtered row, `scratch` holds rowSize bytes.
+    static void filterRow(const u8* row, const u8* above, uint rowSize, u8* out, u8* scratch) {
+      uint64_t bestCost = UINT64_MAX;
+      for(uint type = 0; type < 5; type++) {
+        applyFilter(type, row, above, rowSize, scratch);
+
+        uint64_t cost = 0;
+        for(uint i = 0; i < rowSize; i++) cost += std::abs((int8_t)scratch[i]);
+        if(cost < bestCost) {
+          bestCost = cost;
+          out[0] = type;
+          memcpy(out + 1, scratch, rowSize);
+        }
+      }
+    }
+
+    struct BitWriter {
+      Bytes& out;
+      uint64_t bits = 0;
+      int count = 0;
+
+      void put(uint32_t value, int n) {
+        bits |= (uint64_t)value << count;
+        count += n;
+        while(count >= 8) {
+          out.push_back(bits & 0xff);
+          bits >>= 8;
+          count -= 8;
+        }
+      }
+
+      // Huffman codes go out most significant bit first.
+      void putCode(uint32_t code, int n) {
+        uint32_t reversed = 0;
+        for(int i = 0; i < n; i++) reversed |= ((code >> i) & 1) << (n - 1 - i);
+        put(reversed, n);
+      }
+
+      void alignToByte() {
+        if(count > 0) put(0, 8 - count);
+      }
+    };
+
+    struct Code {
+      uint16_t bits;
+      u8 length;
+    };
+
+    // The fixed Huffman codes of the literal/length symbols, already reversed.
+    static void putLiteral(BitWriter& bits, uint symbol) {
+      static const std::array<Code, 288> codes = [] {
+        std::array<Code, 288> c;
+        for(uint s = 0; s < 288; s++) {
+          uint32_t code = s < 144 ? 0x30 + s : s < 256 ? 0x190 + s - 144 : s < 280 ? s - 256 : 0xc0 + s - 280;
+          u8 length = s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8;
+          uint32_t reversed = 0;
+          for(int i = 0; i < length; i++) reversed |= ((code >> i) & 1) << (length - 1 - i);
+          c[s] = {(uint16_t)reversed, length};
+        }
+        return c;
+      }();
+      bits.put(codes[symbol].bits, codes[symbol].length);
+    }
+
+    static void putMatch(BitWriter& bits, uint length, uint distance) {
+      static const uint16_t lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                              35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+      static const u8 lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                         3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+      static const uint16_t distanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                                257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                                8193, 12289, 16385, 24577};
+      static const u8 distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                           7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+      uint l = 28;
+      while(lengthBase[l] > length) l--;
+      putLiteral(bits, 257 + l);
+      bits.put(length - lengthBase[l], lengthExtra[l]);
+
+      uint d = 29;
+      while(distanceBase[d] > distance) d--;
+      bits.putCode(d, 5);
+      bits.put(distance - distanceBase[d], distanceExtra[d]);
+    }
+
+    // Compresses `data` into a non-final fixed-Huffman deflate block with LZ77
+    // matches inside `data` only, then byte-aligns it with an empty stored
+    // block. Blocks compressed like this on different threads can simply be
+    // concatenated into one stream, the way pigz does it.
+    static void deflateBlock(const u8* data, size_t size, Bytes& out) {
+      constexpr uint hashBits = 15, window = 32768, maxChain = 16, minMatch = 3, maxMatch = 258;
+      std::vector<int32_t> head(1 << hashBits, -1), previous(size, -1);
+      auto hash = [&](size_t i) {
+        uint32_t v = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16);
+        return (v * 2654435761u) >> (32 - hashBits);
+      };
+      auto insert = [&](size_t i) {
+        if(i + minMatch > size) return;
+        uint32_t h = hash(i);
+        previous[i] = head[h];
+        head[h] = i;
+      };
+
+      BitWriter bits{out};
+      bits.put(0, 1); // Not final.
+      bits.put(1, 2); // Fixed Huffman codes.
+
+      size_t i = 0;
+      while(i < size) {
+        uint bestLength = 0, bestDistance = 0;
+
+        if(i + minMatch <= size) {
+          int32_t candidate = head[hash(i)];
+          uint limit = std::min<size_t>(maxMatch, size - i);
+          for(uint chain = 0; candidate >= 0 && i - candidate <= window && chain < maxChain; chain++) {
+            uint length = 0;
+            while(length < limit && data[candidate + length] == data[i + length]) length++;
+            if(length > bestLength) {
+              bestLength = length;
+              bestDistance = i - candidate;
+              if(length == limit) break;
+            }
+            candidate = previous[candidate];
+          }
+        }
+
+        if(bestLength >= minMatch) {
+          putMatch(bits, bestLength, bestDistance);
+          for(uint k = 0; k < bestLength; k++) insert(i + k);
+          i += bestLength;
+        } else {
+          putLiteral(bits, data[i]);
+          insert(i);
+          i++;
+        }
+      }
+
+      putLiteral(bits, 256); // End of block.
+
+      // Empty stored block, to end on a byte boundary.
+      bits.put(0, 1);
+      bits.put(0, 2);
+      bits.alignToByte();
+      append(out, "\x00\x00\xff\xff", 4);
+    }
+
+    bool writePng(const std::filesystem::path& path, const Bytes& rgb) {
+      const uint rowSize = width * 3;
+
+      // Filtered rows, a type byte each, compressed block by block.
+      Bytes filtered((size_t)(rowSize + 1) * height);
+      Bytes zlib = {0x78, 0x01};
+      encodeRows(zlib, [&](uint firstRow, uint endRow, Bytes& out) {
+        Bytes scratch(rowSize);
+        for(uint y = firstRow; y < endRow; y++) {
+          const u8* above = y > 0 ? &rgb[(size_t)(y - 1) * rowSize] : nullptr;
+          filterRow(&rgb[(size_t)y * rowSize], above, rowSize, &filtered[(size_t)y * (rowSize + 1)], scratch.data());
+        }
+        deflateBlock(&filtered[(size_t)firstRow * (rowSize + 1)], (size_t)(endRow - firstRow) * (rowSize + 1), out);
+      });
+
+      // Final empty fixed-Huffman block.
+      zlib.push_back(0x03);
+      zlib.push_back(0x00);
+      appendBE32(zlib, adler32(filtered.data(), filtered.size()));
+
+      Bytes header;
+      appendBE32(header, width);
+      appendBE32(header, height);
+      append(header, "\x08\x02\x00\x00\x00", 5); // 8 bits, RGB, deflate, adaptive filters, no interlace.
+
+      Bytes file;
+      append(file, "\x89PNG\r\n\x1a\n", 8);
+      appendPngChunk(file, "IHDR", header);
+      appendPngChunk(file, "IDAT", zlib);
+      appendPngChunk(file, "IEND", {});
+      return writeFile(path, file);
+    }
+
+    // EXR ---------------------------------------------------------------------
+
+    static void appendExrAttribute(Bytes& out, const char* name, const char* type, const Bytes& value) {
+      append(out, name, strlen(name) + 1);
+      append(out, type, strlen(type) + 1);
+      appendLE<int32_t>(out, value.size());
+      append(out, value.data(), value.size());
+    }
+
+    bool writeExr(const std::filesystem::path& path, const float* rgba, int samplesPerPixel) {
+      Bytes channels;
+      // Channels are stored in alphabetical order.
+      for(const char* name : {"B", "G", "R"}) {
+        append(channels, name, 2);
+        appendLE<int32_t>(channels, 2); // FLOAT
+        appendLE<int32_t>(channels, 0); // pLinear and reserved.
+        appendLE<int32_t>(channels, 1); // x sampling
+        appendLE<int32_t>(channels, 1); // y sampling
+      }
+      channels.push_back(0);
+
+      Bytes window;
+      for(int32_t v : {0, 0, (int32_t)width - 1, (int32_t)height - 1}) appendLE(window, v);
+
+      Bytes one, zero2, compression = {0}, lineOrder = {0};
+      appendLE(one, 1.0f);
+      appendLE(zero2, 0.0f);
+      appendLE(zero2, 0.0f);
+
+      Bytes file = {0x76, 0x2f, 0x31, 0x01};
+      appendLE<int32_t>(file, 2);
+      appendExrAttribute(file, "channels", "chlist", channels);
+      appendExrAttribute(file, "compression", "compression", compression);
+      appendExrAttribute(file, "dataWindow", "box2i", window);
+      appendExrAttribute(file, "displayWindow", "box2i", window);
+      appendExrAttribute(file, "lineOrder", "lineOrder", lineOrder);
+      appendExrAttribute(file, "pixelAspectRatio", "float", one);
+      appendExrAttribute(file, "screenWindowCenter", "v2f", zero2);
+      appendExrAttribute(file, "screenWindowWidth", "float", one);
+      file.push_back(0);
+
+      // One scanline per chunk, every chunk is the same size.
+      const uint64_t lineBytes = (uint64_t)width * 3 * sizeof(float);
+      const uint64_t firstLine = file.size() + height * sizeof(uint64_t);
+      for(uint y = 0; y < height; y++) appendLE<uint64_t>(file, firstLine + y * (8 + lineBytes));
+
+      encodeRows(file, [&](uint firstRow, uint endRow, Bytes& out) {
+        out.reserve((endRow - firstRow) * (8 + lineBytes));
+        std::vector<float> line(width * 3);
+        for(uint y = firstRow; y < endRow; y++) {
+          for(uint x = 0; x < width; x++) {
+            auto rgb = linear(rgba, (size_t)y * width + x, samplesPerPixel);
+            line[x]             = rgb[2];
+            line[width + x]     = rgb[1];
+            line[2 * width + x] = rgb[0];
+          }
+          appendLE<int32_t>(out, y);
+          appendLE<int32_t>(out, lineBytes);
+          append(out, line.data(), lineBytes);
+        }
+      });
+
+      return writeFile(path, file);
+    }
+
+  public:
+    // 0 threads uses every core.
+    ImageWriter(uint width, uint height, uint threadCount = 0)
+      : width(width), height(height), pool(threadCount > 0 ? threadCount : std::thread::hardware_concurrency())
+    {}
+
+    // `rgb` are the RGB8 pixels from `ImageResolve`, for the 8-bit formats.
+    bool write(const std::filesystem::path& path, ImageFormat format, const Bytes& rgb) {
+      switch(format) {
+        case ImageFormat::PPMText: {
+          static const std::array<std::string, 256> decimal = [] {
+            std::array<std::string, 256> d;
+            for(int v = 0; v < 256; v++) d[v] = std::to_string(v);
+            return d;
+          }();
+
+          Bytes file;
+          append(file, fmt("P3\n%d %d\n255\n", width, height));
+          encodeRows(file, [&](uint firstRow, uint endRow, Bytes& out) {
+            for(size_t i = (size_t)firstRow * width * 3; i < (size_t)endRow * width * 3; i++) {
+              const std::string& digits = decimal[rgb[i]];
+              append(out, digits.data(), digits.size());
+              out.push_back(i % 3 == 2 ? '\n' : ' ');
+            }
+          });
+          return writeFile(path, file);
+        }
+        case ImageFormat::PPM: {
+          Bytes file;
+          append(file, fmt("P6\n%d %d\n255\n", width, height));
+          append(file, rgb.data(), rgb.size());
+          return writeFile(path, file);
+        }
+        case ImageFormat::PNG:
+          return writePng(path, rgb);
+        default:
+          fprintf(stderr, "%s needs the float image\n", imageFormatName(format));
+          return false;
+      }
+    }
+
+    // `rgba` is the accumulation image read back from the device. A
+    // samplesPerPixel of 0 divides each pixel by its own sample count.
+    bool write(const std::filesystem::path& path, ImageFormat format, const float* rgba, int samplesPerPixel) {
+      switch(format) {
+        case ImageFormat::PFM: {
+          Bytes file;
+          // A negative scale means little-endian. Rows go bottom to top.
+          append(file, fmt("PF\n%d %d\n-1.0\n", width, height));
+          encodeRows(file, [&](uint firstRow, uint endRow, Bytes& out) {
+            out.reserve((size_t)(endRow - firstRow) * width * 3 * sizeof(float));
+            for(uint row = firstRow; row < endRow; row++) {
+              uint y = height - 1 - row;
+              for(uint x = 0; x < width; x++) {
+                auto rgb = linear(rgba, (size_t)y * width + x, samplesPerPixel);
+                append(out, rgb.data(), sizeof(rgb));
+              }
+            }
+          });
+          return writeFile(path, file);
+        }
+        case ImageFormat::EXR:
+          return writeExr(path, rgba, samplesPerPixel);
+        default:
+          fprintf(stderr, "%s needs the 8-bit image\n", imageFormatName(format));
+          return false;
+      }
+    }
+};
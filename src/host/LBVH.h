@@ -0,0 +1,151 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <vector>
+
+#include "common/bvh_node.h"
+#include "common/sphere.h"
+#include "host/CLBuffer.h"
+#include "host/CLKernel.h"
+#include "host/CLUtil.h"
+
+// Builds a BVH on the device from spheres that are already uploaded, see
+// `kernels/lbvh.cl` for the algorithm. Meant for scenes that change every
+// frame, where building on the host and uploading the nodes costs more than
+// the tree quality gained from SAH.
+class LBVH {
+  private:
+    cl_context context;
+    cl_command_queue queue;
+    cl_device_id device;
+
+    cl_program program;
+    cl_kernel centroidBounds, mortonCodes, radixHistogram, radixScan, radixScatter, gatherSpheres, buildHierarchy, fitBounds;
+
+    static constexpr uint radixBits = 4;
+    static constexpr uint radixBuckets = 1 << radixBits;
+    static constexpr uint radixTile = 256;
+    static constexpr uint mortonBits = 30;
+    static constexpr size_t scanGroupSize = 256;
+
+    cl_kernel createKernel(const char* name) {
+      cl_int err;
+      cl_kernel kernel = clCreateKernel(program, name, &err);
+      clErr(err);
+      return kernel;
+    }
+
+    cl_mem createScratch(size_t bytes) {
+      cl_int err;
+      cl_mem buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, nullptr, &err);
+      clErr(err);
+      return buffer;
+    }
+
+    void enqueue(cl_kernel kernel, size_t globalSize) {
+      if(globalSize == 0) return;
+      clErr(clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &globalSize, nullptr, 0, nullptr, nullptr));
+    }
+
+  public:
+    LBVH(cl_context& context, cl_command_queue& queue, cl_device_id& device)
+      : context(context), queue(queue), device(device)
+    {
+      program = buildProgram("src/kernels/lbvh.cl", context, device, {"./src"});
+
+      centroidBounds = createKernel("lbvh_centroid_bounds");
+      mortonCodes    = createKernel("lbvh_morton_codes");
+      radixHistogram = createKernel("lbvh_radix_histogram");
+      radixScan      = createKernel("lbvh_radix_scan");
+      radixScatter   = createKernel("lbvh_radix_scatter");
+      gatherSpheres  = createKernel("lbvh_gather_spheres");
+      buildHierarchy = createKernel("lbvh_build_hierarchy");
+      fitBounds      = createKernel("lbvh_fit_bounds");
+    }
+
+    ~LBVH() {
+      for(cl_kernel k : {centroidBounds, mortonCodes, radixHistogram, radixScan, radixScatter, gatherSpheres, buildHierarchy, fitBounds}) {
+        clReleaseKernel(k);
+      }
+      clReleaseProgram(program);
+    }
+
+    LBVH(const LBVH&) = delete;
+    LBVH& operator=(const LBVH&) = delete;
+
+    // `spheres` must already be uploaded. Its device copy is reordered along
+    // the Morton curve, the host copy is left as is.
+    // `nodes` is (re)allocated on the device and filled in, nothing is uploaded.
+    void build(CLBuffer<Sphere>& spheres, CLBuffer<BVHNode>& nodes) {
+      auto start = std::chrono::high_resolution_clock::now();
+
+      uint sphereCount = spheres.count();
+      assert(sphereCount > 0 && "LBVH needs at least one sphere");
+
+      uint nodeCount = 2 * sphereCount - 1;
+      uint tileCount = (sphereCount + radixTile - 1) / radixTile;
+      uint histogramSize = radixBuckets * tileCount;
+
+      nodes.allocateOnDevice(context, nodeCount);
+
+      cl_mem bounds        = createScratch(6 * sizeof(uint));
+      cl_mem codes[2]      = { createScratch(sphereCount * sizeof(uint)), createScratch(sphereCount * sizeof(uint)) };
+      cl_mem indices[2]    = { createScratch(sphereCount * sizeof(uint)), createScratch(sphereCount * sizeof(uint)) };
+      cl_mem histogram     = createScratch(histogramSize * sizeof(uint));
+      cl_mem sortedSpheres = createScratch(sphereCount * sizeof(Sphere));
+      cl_mem internalSlot  = createScratch(sphereCount * sizeof(uint));
+      cl_mem parent        = createScratch(nodeCount * sizeof(uint));
+      cl_mem leafSlot      = createScratch(sphereCount * sizeof(uint));
+      cl_mem visits        = createScratch(sphereCount * sizeof(uint));
+
+      const std::array<uint, 6> initialBounds = { UINT32_MAX, UINT32_MAX, UINT32_MAX, 0, 0, 0 };
+      clErr(clEnqueueWriteBuffer(queue, bounds, CL_FALSE, 0, sizeof(initialBounds), initialBounds.data(), 0, nullptr, nullptr));
+
+      const uint zero = 0;
+      clErr(clEnqueueFillBuffer(queue, visits, &zero, sizeof(zero), 0, sphereCount * sizeof(uint), 0, nullptr, nullptr));
+
+      kernelParameters(centroidBounds, 0, spheres, sphereCount, bounds);
+      enqueue(centroidBounds, sphereCount);
+
+      kernelParameters(mortonCodes, 0, spheres, sphereCount, bounds, codes[0], indices[0]);
+      enqueue(mortonCodes, sphereCount);
+
+      // An even number of passes, so the sorted keys end up back in [0].
+      static_assert(((mortonBits + radixBits - 1) / radixBits) % 2 == 0);
+      for(uint shift = 0, pass = 0; shift < mortonBits; shift += radixBits, pass++) {
+        uint in = pass % 2, out = 1 - in;
+
+        kernelParameters(radixHistogram, 0, codes[in], sphereCount, shift, histogram);
+        enqueue(radixHistogram, tileCount);
+
+        kernelParameters(radixScan, 0, histogram, histogramSize);
+        clErr(clSetKernelArg(radixScan, 2, scanGroupSize * sizeof(uint), nullptr));
+        size_t scanSize = scanGroupSize;
+        clErr(clEnqueueNDRangeKernel(queue, radixScan, 1, nullptr, &scanSize, &scanSize, 0, nullptr, nullptr));
+
+        kernelParameters(radixScatter, 0, codes[in], indices[in], sphereCount, shift, histogram, codes[out], indices[out]);
+        enqueue(radixScatter, tileCount);
+      }
+
+      kernelParameters(gatherSpheres, 0, spheres, indices[0], sphereCount, sortedSpheres);
+      enqueue(gatherSpheres, sphereCount);
+      clErr(clEnqueueCopyBuffer(queue, sortedSpheres, spheres.devBuffer(), 0, 0, sphereCount * sizeof(Sphere), 0, nullptr, nullptr));
+
+      kernelParameters(buildHierarchy, 0, codes[0], sphereCount, nodes, internalSlot, parent, leafSlot);
+      enqueue(buildHierarchy, std::max(sphereCount - 1, 1u));
+
+      kernelParameters(fitBounds, 0, spheres, sphereCount, nodes, internalSlot, parent, leafSlot, visits);
+      enqueue(fitBounds, sphereCount);
+
+      clErr(clFinish(queue));
+
+      for(cl_mem m : {bounds, codes[0], codes[1], indices[0], indices[1], histogram, sortedSpheres, internalSlot, parent, leafSlot, visits}) {
+        clReleaseMemObject(m);
+      }
+
+      auto end = std::chrono::high_resolution_clock::now();
+      auto buildTime = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+      std::cout << "BVH built with " << nodeCount << " Nodes in " << buildTime << " ms (LBVH, device).\n";
+    }
+};
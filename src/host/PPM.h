@@ -1,3 +1,5 @@
+#pragma once
+
 #include <filesystem>
 #include <math.h>
 #include <stdio.h>
@@ -24,7 +26,8 @@ class PPMImage {
 		float* data;
 
 	public:
-		PPMImage(cl_command_queue& queue, cl_context& context, int w, int h, float3 color) : 
+		// Aborts if the device can't make the image, unless `status` takes the error.
+		PPMImage(cl_command_queue& queue, cl_context& context, int w, int h, float3 color, cl_int* status = nullptr) : 
 			width(w), height(h), queue(queue)
 		{
 
@@ -45,12 +48,13 @@ class PPMImage {
 			desc.buffer = NULL;
 
 			this->clImage = clCreateImage(context, CL_MEM_READ_WRITE, &format, &desc, nullptr, &err);
-			clErr(err);
+			clErrOr(err, status);
 
 			// OpenCL doesn't support RGB + Floats
 			// So we use RGBA + Floats 
 			// Also, reading and writing to and from the device is quite a bit easier.
-			this->data = new float[w * h * RGBA_CHANNELS];
+			// Zeroed so alpha, the sample count, starts at 0.
+			this->data = new float[w * h * RGBA_CHANNELS]();
 			for (int y = 0; y < h; y++) {
 				for (int x = 0; x < w; x++) {
 					this->write_pixel_rgb_f32(x, y, color.s[0], color.s[1], color.s[2]);
@@ -58,6 +62,14 @@ class PPMImage {
 			}
 		}
 
+		~PPMImage() {
+			if(clImage != nullptr) clReleaseMemObject(clImage);
+			delete[] data;
+		}
+
+		PPMImage(const PPMImage&) = delete;
+		PPMImage& operator=(const PPMImage&) = delete;
+
 		static PPMImage magenta(cl_command_queue& queue, cl_context& context, int w, int h) {
 			return PPMImage(queue, context, w, h, f3(1, 0, 1));
 		}
@@ -73,14 +85,32 @@ class PPMImage {
 			clErr(clEnqueueWriteImage(this->queue, this->clImage, CL_TRUE, origin.data(), region.data(), 0, 0, (void*)this->data, 0, NULL, NULL));
 		}
 
-		void read_from_device() {
+		void read_from_device(cl_int* status = nullptr) {
 			const std::array<size_t, 3> origin = {0, 0, 0};
 			const std::array<size_t, 3> region = {(size_t)this->width, (size_t)this->height, 1};
 			
-			clErr(clEnqueueReadImage(this->queue, this->clImage, CL_TRUE, origin.data(), region.data(), 0, 0, this->data, 0, NULL, NULL));
+			clErrOr(clEnqueueReadImage(this->queue, this->clImage, CL_TRUE, origin.data(), region.data(), 0, 0, this->data, 0, NULL, NULL), status);
 		}
 
-		void write_to_file(const std::filesystem::path path, int samples_per_pixel) const {
+		// Replaces the pixels, RGBA. Takes effect on `write_to_device`.
+		void load_rgba_f32(const float* rgba) {
+			std::copy(rgba, rgba + (size_t)width * height * RGBA_CHANNELS, data);
+		}
+
+		// Sets alpha, the sample count, of every pixel. Takes effect on `write_to_device`.
+		void set_sample_count(float samples) {
+			for(size_t i = 0; i < (size_t)width * height; i++) {
+				data[i * RGBA_STRIDE + 3] = samples;
+			}
+		}
+
+		// RGBA, alpha counts the samples. Valid after `read_from_device`.
+		const float* pixels() const {
+			return data;
+		}
+
+		// Samples per pixel (alpha) from blue for none to red for max_samples.
+		void write_sample_heatmap(const std::filesystem::path path, int max_samples) const {
 			FILE* f = fopen(path.c_str(), "w");
 
 			if(f == NULL) {
@@ -92,30 +122,18 @@ class PPMImage {
 			fprintf(f, "%d %d\n" , width, height);
 			fprintf(f, "255\n");
 
-			float gamma_scale = 1.0f / samples_per_pixel;
-
 			for (int y = 0; y < height; y++) {
 				for (int x = 0; x < width; x++) {
 					int index = (y * width + x) * RGBA_STRIDE;
-					float r = data[index + 0];
-					float g = data[index + 1];
-					float b = data[index + 2];
-
-					r = std::clamp(sqrt(gamma_scale * r), 0.0f, 0.999f);
-					g = std::clamp(sqrt(gamma_scale * g), 0.0f, 0.999f);
-					b = std::clamp(sqrt(gamma_scale * b), 0.0f, 0.999f);
-					
-					u8 r_u8 = 256 * r;
-					u8 g_u8 = 256 * g;
-					u8 b_u8 = 256 * b;
-
-					fprintf(f, "%d %d %d\n", r_u8, g_u8, b_u8);
-				}	
+					float t = std::clamp(data[index + 3] / max_samples, 0.0f, 1.0f);
+
+					fprintf(f, "%d %d %d\n", (int)(255 * t), 0, (int)(255 * (1 - t)));
+				}
 			}
 
 			fclose(f);
 
-			printf("Image successfully written at %s\n", path.c_str());
+			printf("Sample heatmap written at %s\n", path.c_str());
 		}
 
 		void write_pixel_rgb_f32(int x, int y, float r, float g, float b) {
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <unistd.h>
+
+#include "host/CLUtil.h"
+#include "host/Hash.h"
+#include "host/Utils.h"
+
+// Keeps the binaries of built programs on disk, so later runs skip the
+// compiler. The key hashes the kernel source and every header it includes,
+// the build flags and the device, so editing any of them builds again.
+//
+// File layout: `Header`, then the binary of the one device.
+class ProgramCache {
+  private:
+    struct Header {
+      char magic[8];
+      uint64_t key;
+      uint64_t size;
+      // How long building from source took, to tell what a hit saves.
+      double buildMs;
+    };
+
+    static constexpr char magic[8] = "CRTPRG1";
+
+    inline static std::filesystem::path directory = ".program_cache";
+
+    std::filesystem::path path;
+    uint64_t key;
+
+    // `file`, then the headers it includes in the order they're included.
+    // Quoted includes are looked up next to the including file, then in
+    // `includes`, like the compiler does. Includes behind #ifdefs count too,
+    // a few too many only invalidate more often.
+    static void addSource(Hash& hash, const std::filesystem::path& file, const std::vector<std::string>& includes,
+                          std::unordered_set<std::string>& seen) {
+      std::error_code err;
+      std::filesystem::path canonical = std::filesystem::weakly_canonical(file, err);
+      if(err || !seen.insert(canonical.string()).second) return;
+
+      std::ifstream in(file);
+      std::string source(std::istreambuf_iterator<char>(in), {});
+      hash.add(canonical.string()).add(source);
+
+      size_t at = 0;
+      while((at = source.find("#include", at)) != std::string::npos) {
+        size_t open = source.find_first_of("\"\n", at);
+        at += 8;
+        if(open == std::string::npos || source[open] != '"') continue;
+        size_t close = source.find('"', open + 1);
+        if(close == std::string::npos) break;
+        std::string name = source.substr(open + 1, close - open - 1);
+
+        std::vector<std::filesystem::path> candidates = {file.parent_path() / name};
+        for(const std::string& include : includes) candidates.push_back(std::filesystem::path(include) / name);
+        for(const auto& candidate : candidates) {
+          if(std::filesystem::is_regular_file(candidate, err)) {
+            addSource(hash, candidate, includes, seen);
+            break;
+          }
+        }
+      }
+    }
+
+  public:
+    // Empty turns the cache off.
+    static void setDirectory(const std::filesystem::path& d) { directory = d; }
+    static bool enabled() { return !directory.empty(); }
+
+    // `device` tells the device and its driver apart from others, e.g. their
+    // names and versions.
+    ProgramCache(const std::string& kernelFile, const std::vector<std::string>& includes, const std::string& flags,
+                 const std::string& device) {
+      Hash hash;
+      std::unordered_set<std::string> seen;
+      addSource(hash, kernelFile, includes, seen);
+      hash.add(flags).add(device);
+
+      key = hash.get();
+      path = directory / fmt("%s-%s.bin", std::filesystem::path(kernelFile).stem().c_str(), hash.hex().c_str());
+    }
+
+    // The built program, or nothing if it isn't cached or the device turns
+    // the binary down. Sets `buildMs` to what building it took back then.
+    std::optional<cl_program> load(cl_context& context, cl_device_id& device, const std::string& flags, double& buildMs) {
+      std::ifstream in(path, std::ios::binary);
+      if(!in) return std::nullopt;
+
+      Header h;
+      in.read(reinterpret_cast<char*>(&h), sizeof(h));
+      if(!in || !std::equal(magic, magic + sizeof(magic), h.magic) || h.key != key) return std::nullopt;
+
+      std::vector<unsigned char> binary(h.size);
+      in.read(reinterpret_cast<char*>(binary.data()), binary.size());
+      if(!in) return std::nullopt;
+
+      const unsigned char* binaries[] = {binary.data()};
+      const size_t sizes[] = {binary.size()};
+      cl_int status, err;
+      cl_program program = clCreateProgramWithBinary(context, 1, &device, sizes, binaries, &status, &err);
+      if(err != CL_SUCCESS) return std::nullopt;
+
+      if(status != CL_SUCCESS || clBuildProgram(program, 1, &device, flags.c_str(), NULL, NULL) != CL_SUCCESS) {
+        clReleaseProgram(program);
+        return std::nullopt;
+      }
+
+      buildMs = h.buildMs;
+      return program;
+    }
+
+    // Written next to the final file and renamed, so runs sharing the
+    // directory never read half a binary.
+    void store(cl_program program, double buildMs) {
+      size_t size = 0;
+      clErr(clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, nullptr));
+      if(size == 0) return;
+
+      std::vector<unsigned char> binary(size);
+      unsigned char* binaries[] = {binary.data()};
+      clErr(clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, nullptr));
+
+      Header h = {};
+      std::copy(magic, magic + sizeof(magic), h.magic);
+      h.key = key;
+      h.size = size;
+      h.buildMs = buildMs;
+
+      std::error_code err;
+      std::filesystem::create_directories(directory, err);
+
+      std::filesystem::path tmpPath = path;
+      tmpPath += fmt(".%d.tmp", getpid());
+
+      std::ofstream out(tmpPath, std::ios::binary);
+      out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+      out.write(reinterpret_cast<const char*>(binary.data()), binary.size());
+      out.close();
+
+      if(out) std::filesystem::rename(tmpPath, path, err);
+      if(!out || err) {
+        std::cerr << fmt("Couldn't write the program binary to %s.\n", path.c_str());
+        std::filesystem::remove(tmpPath, err);
+      }
+    }
+};
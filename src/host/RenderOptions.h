@@ -0,0 +1,102 @@
+#pragma once
+
+#include <optional>
+#include <string>
+
+#include "host/ImageWriter.h"
+
+enum class Integrator {
+	// test_kernel.cl, a whole path per work-item.
+	Megakernel,
+	// wavefront.cl, paths advanced one bounce at a time by small kernels.
+	Wavefront,
+	// persistent_kernel.cl, resident work-groups pulling pixels from a queue.
+	Persistent
+};
+
+inline const char* integratorName(Integrator integrator) {
+	switch(integrator) {
+		case Integrator::Wavefront:  return "wavefront";
+		case Integrator::Persistent: return "persistent";
+		default:                     return "megakernel";
+	}
+}
+
+// Where random_float gets its numbers, see device/sampler.h.
+enum class Sampler {
+	Random,
+	// -DSAMPLER_SOBOL
+	Sobol,
+	// -DSAMPLER_BLUE_NOISE
+	BlueNoise
+};
+
+// Every sampler numbers the samples of a pixel with 20 bits, see device/sampler.h.
+constexpr int maxSamplesPerPixel = 1 << 20;
+
+inline const char* samplerName(Sampler sampler) {
+	switch(sampler) {
+		case Sampler::Sobol:     return "sobol";
+		case Sampler::BlueNoise: return "bluenoise";
+		default:                 return "random";
+	}
+}
+
+struct RenderOptions {
+	Integrator integrator = Integrator::Megakernel;
+	Sampler sampler = Sampler::Random;
+	// Keeps the old rejection loops for the random directions and lens
+	// samples, to compare images against. Builds with -DREJECTION_SAMPLING.
+	bool rejectionSampling = false;
+
+	// Samples a pixel takes per launch. The megakernel and persistent
+	// integrators sum them in registers and write the image once, the
+	// wavefront one enqueues them back to back.
+	int samplesPerLaunch = 1;
+
+	// Bounces before Russian roulette may stop a path, 0 disables it. Builds
+	// the kernels with -DRUSSIAN_ROULETTE_MIN_DEPTH.
+	int russianRouletteDepth = 0;
+
+	// Sorts the hits by material before shading, wavefront only. Builds
+	// wavefront.cl with -DWF_SORT_HITS.
+	bool sortHits = false;
+
+	// Work-groups launched by the persistent integrator. 0 guesses how many
+	// the device keeps resident.
+	int persistentGroups = 0;
+
+	// Adaptive sampling, see `AdaptiveSampler`. Pixels stop once the noise of
+	// their mean drops below the threshold, after at least
+	// `adaptiveMinSamples` samples. 0 disables it.
+	float noiseThreshold = 0;
+	int adaptiveMinSamples = 16;
+
+	// Checkpoints, see `Checkpoint`. Every `checkpointEvery` milliseconds, or
+	// samples if `checkpointInSamples`, 0 for never. They go to the output
+	// file name with ".ckpt" appended.
+	int checkpointEvery = 0;
+	bool checkpointInSamples = false;
+	// Checkpoint to go on from, empty to start from scratch.
+	std::string resumePath;
+
+	// Renders only samples [sampleRangeStart, sampleRangeStart +
+	// sampleRangeCount) of every pixel, 0 samples for all of them. The
+	// accumulation image is left in a checkpoint for sample_merge.
+	int sampleRangeStart = 0;
+	int sampleRangeCount = 0;
+
+	// Output file format, from the file extension if not set.
+	std::optional<ImageFormat> outputFormat;
+
+	// Where to write the samples each pixel took, empty for nowhere.
+	std::string sampleHeatmapPath;
+
+	// Where built programs are kept, see `ProgramCache`. Empty for nowhere.
+	std::string programCacheDirectory = ".program_cache";
+
+	// Keep the kernels built and render the jobs of stdin, or of the clients of
+	// a Unix socket at `serveSocketPath`, see `RenderServer`.
+	bool serve = false;
+	std::string serveSocketPath;
+};
@@ -0,0 +1,501 @@
+#pragma once
+
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "host/BVH.h"
+#include "host/BVHRefit.h"
+#include "host/CLBuffer.h"
+#include "host/CLKernel.h"
+#include "host/ImageResolve.h"
+#include "host/ImageWriter.h"
+#include "host/LBVH.h"
+#include "host/PPM.h"
+#include "host/RenderOptions.h"
+#include "host/SkipLinkBVH.h"
+#include "host/WideBVH.h"
+#include "host/builtin_scenes.h"
+
+// One render for `RenderServer`, a line of key=value pairs:
+//   scene=1 width=320 height=180 samples=16 output=thumbs/1.png lookfrom=13,2,3
+// Keys: scene, width, height, samples, depth, output, format, lookfrom,
+// lookat, vup, vfov, aperture, focus and time. The ones left out come from
+// the scene, like for CRT, time from 0. Values can't have spaces.
+//
+// time animates the scene, see `builtin_scene_bounce`. A sequence of frames
+// is a job per frame with increasing times.
+struct RenderJob {
+  int scene = 0;
+  std::optional<int> width, height, samples, maxDepth;
+  std::optional<float3> lookfrom, lookat, vup;
+  std::optional<float> vfov, aperture, focusDist, time;
+  std::string output = "output.ppm";
+  std::optional<ImageFormat> format;
+
+  static bool parseValue(const std::string& s, int& value) {
+    char* end;
+    long v = std::strtol(s.c_str(), &end, 10);
+    value = v;
+    return !s.empty() && *end == '\0' && v >= 0 && v <= INT_MAX;
+  }
+
+  static bool parseValue(const std::string& s, float& value) {
+    char* end;
+    value = std::strtof(s.c_str(), &end);
+    return !s.empty() && *end == '\0';
+  }
+
+  // x,y,z
+  static bool parseValue(const std::string& s, float3& value) {
+    std::istringstream in(s);
+    std::string part;
+    for(int i = 0; i < 3; i++) {
+      if(!std::getline(in, part, ',') || !parseValue(part, value.s[i])) return false;
+    }
+    return in.peek() == EOF;
+  }
+
+  template<typename T> static bool parseValue(const std::string& s, std::optional<T>& value) {
+    return parseValue(s, value.emplace());
+  }
+
+  // Sets `error` and returns nothing if the line is no job.
+  static std::optional<RenderJob> parse(const std::string& line, std::string& error) {
+    RenderJob job;
+    std::istringstream words(line);
+    std::string word;
+
+    while(words >> word) {
+      size_t equals = word.find('=');
+      if(equals == std::string::npos) {
+        error = fmt("expected key=value, got \"%s\"", word.c_str());
+        return std::nullopt;
+      }
+
+      std::string key = word.substr(0, equals), value = word.substr(equals + 1);
+      bool valid;
+      if(key == "scene")         valid = parseValue(value, job.scene);
+      else if(key == "width")    valid = parseValue(value, job.width) && *job.width > 0;
+      else if(key == "height")   valid = parseValue(value, job.height) && *job.height > 0;
+      else if(key == "samples")  valid = parseValue(value, job.samples) && *job.samples > 0;
+      else if(key == "depth")    valid = parseValue(value, job.maxDepth) && *job.maxDepth > 0;
+      else if(key == "lookfrom") valid = parseValue(value, job.lookfrom);
+      else if(key == "lookat")   valid = parseValue(value, job.lookat);
+      else if(key == "vup")      valid = parseValue(value, job.vup);
+      else if(key == "vfov")     valid = parseValue(value, job.vfov);
+      else if(key == "aperture") valid = parseValue(value, job.aperture);
+      else if(key == "focus")    valid = parseValue(value, job.focusDist);
+      else if(key == "time")     valid = parseValue(value, job.time);
+      else if(key == "format")   valid = (job.format = imageFormatFromName(value)).has_value();
+      else if(key == "output") {
+        job.output = value;
+        valid = !value.empty();
+      } else {
+        error = fmt("unknown key \"%s\"", key.c_str());
+        return std::nullopt;
+      }
+
+      if(!valid) {
+        error = fmt("invalid value for %s (%s)", key.c_str(), value.c_str());
+        return std::nullopt;
+      }
+    }
+
+    return job;
+  }
+};
+
+// Renders job after job with the megakernel, for `--serve`. The context,
+// queue and compiled kernels stay for the life of the server, and only what a
+// job changes gets uploaded again: the scene buffers and the BVH when the
+// scene changes, the image when the resolution does. The camera, sample
+// count and depth are kernel arguments. When only the time changes the
+// spheres move and the tree is refitted on the device, see `BVHRefitter`.
+//
+// A job that asks for more than the device has, or that the device fails,
+// is answered with an error and the server goes on with the next one.
+class RenderServer {
+  private:
+    // Deeper paths only repeat the random numbers of earlier bounces, see
+    // RNG_BOUNCE_BITS in device/sampler.h.
+    static constexpr int maxDepth = 64;
+
+    cl_context context;
+    cl_command_queue queue;
+    cl_device_id device;
+
+    BVHBuildOptions bvhOptions;
+    int samplesPerLaunch;
+    // The kernel takes at most this many samples per pixel.
+    int maxSamples;
+    size_t maxImageWidth, maxImageHeight;
+    cl_ulong maxAllocSize;
+
+    cl_kernel kernel;
+    std::unique_ptr<LBVH> lbvh;
+    std::unique_ptr<BVHRefitter> refitter;
+    std::unique_ptr<ImageResolve> resolve;
+    std::unique_ptr<ImageWriter> writer;
+    std::unique_ptr<PPMImage> image;
+
+    // What the loaded scene brought along, and its buffers.
+    std::optional<int> scene;
+    float sceneTime = 0;
+    Camera sceneCamera;
+    int sceneWidth, sceneHeight, sceneSamples, sceneDepth;
+
+    CLBuffer<Sphere> spheres;
+    CLBuffer<Lambertian> lambertians;
+    CLBuffer<Metal> metals;
+    CLBuffer<Dielectric> dielectrics;
+    CLBuffer<Texture> textures;
+    CLBuffer<BVHNode> bvhNodes;
+
+    // The nodes the kernel walks. Either bvhNodes, or a layout derived from
+    // them in `derivedNodes`.
+    cl_mem traversalNodes = nullptr, derivedNodes = nullptr;
+    uint traversalNodeCount = 0;
+
+    // "<what> failed (<CL error>)", empty for CL_SUCCESS.
+    static std::string clFailure(const char* what, cl_int err) {
+      return err == CL_SUCCESS ? "" : fmt("%s failed (%s)", what, clErrorString(err));
+    }
+
+    template<typename Node> std::string useDerivedNodes(const std::vector<Node>& nodes) {
+      cl_int err;
+      derivedNodes = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, nodes.size() * sizeof(Node),
+                                    (void*)nodes.data(), &err);
+      if(err != CL_SUCCESS) derivedNodes = nullptr;
+      traversalNodes = derivedNodes;
+      traversalNodeCount = nodes.size();
+      return clFailure("uploading the BVH", err);
+    }
+
+    template<typename T> std::string upload(CLBuffer<T>& buffer, std::vector<T>& instances) {
+      buffer.releaseDevice();
+      buffer = CLBuffer<T>::fromVector(context, queue, instances);
+
+      cl_int err;
+      buffer.uploadToDevice(context, &err);
+      return clFailure("uploading the scene", err);
+    }
+
+    // Builds the scene and its BVH the way CRT does, and uploads them.
+    // Returns what went wrong, empty if nothing did.
+    std::string loadScene(int id) {
+      clear_scene();
+      sceneCamera = Camera();
+      sceneWidth = 1920;
+      sceneHeight = 1080;
+      sceneSamples = 100;
+      sceneDepth = 10;
+      load_builtin_scene(id, sceneCamera, sceneWidth, sceneHeight, sceneSamples, sceneDepth);
+
+      std::string error = upload(lambertians, Lambertian::instances);
+      if(error.empty()) error = upload(metals, Metal::instances);
+      if(error.empty()) error = upload(dielectrics, Dielectric::instances);
+      if(error.empty()) error = upload(textures, Texture::instances);
+      if(!error.empty()) return error;
+
+      scene = id;
+      sceneTime = 0;
+      return buildTree(Sphere::instances);
+    }
+
+    // Builds the BVH over `sphereList` and uploads both. Afterwards the host
+    // and device copies of `spheres` are in the order the tree expects.
+    std::string buildTree(std::vector<Sphere>& sphereList) {
+      bvhNodes.releaseDevice();
+      bvhNodes = CLBuffer<BVHNode>(context, queue);
+      if(bvhOptions.builder == BVHBuilder::SAH) {
+        BVH bvh = BVH(sphereList, bvhOptions);
+        bvhNodes = CLBuffer<BVHNode>::fromPtr(context, queue, bvh.getPool(), bvh.getNodesUsed());
+
+        cl_int err;
+        bvhNodes.uploadToDevice(context, &err);
+        if(err != CL_SUCCESS) return clFailure("uploading the BVH", err);
+      }
+
+      std::string error = upload(spheres, sphereList);
+      if(!error.empty()) return error;
+
+      if(bvhOptions.builder == BVHBuilder::LBVH) {
+        if(!lbvh) lbvh = std::make_unique<LBVH>(context, queue, device);
+        lbvh->build(spheres, bvhNodes);
+        spheres.readFromDevice();
+        if(derivedLayout()) bvhNodes.readFromDevice();
+      }
+
+      if(refitter) refitter->setTree(bvhNodes);
+      return deriveNodes();
+    }
+
+    bool derivedLayout() const { return bvhOptions.width > 2 || bvhOptions.traversal != BVHTraversal::Stack; }
+
+    // Points the kernel at bvhNodes, or at the layout the options derive
+    // from their host copy.
+    std::string deriveNodes() {
+      if(derivedNodes != nullptr) clReleaseMemObject(derivedNodes);
+      derivedNodes = nullptr;
+      traversalNodes = bvhNodes.devBuffer();
+      traversalNodeCount = bvhNodes.count();
+
+      if(bvhOptions.traversal == BVHTraversal::SkipLinks) {
+        return useDerivedNodes(SkipLinkBVH(&bvhNodes[0], bvhNodes.count()).getNodes());
+      } else if(bvhOptions.width == 4) {
+        BVH4 wide(&bvhNodes[0], bvhNodes.count());
+        if(!wide.stackError().empty()) return wide.stackError();
+        if(bvhOptions.compressed) return useDerivedNodes(wide.compress());
+        else                      return useDerivedNodes(wide.getNodes());
+      } else if(bvhOptions.width == 8) {
+        BVH8 wide(&bvhNodes[0], bvhNodes.count());
+        if(!wide.stackError().empty()) return wide.stackError();
+        if(bvhOptions.compressed) return useDerivedNodes(wide.compress());
+        else                      return useDerivedNodes(wide.getNodes());
+      }
+      return "";
+    }
+
+    // Moves the spheres to where they are at `time` and refits the tree,
+    // or rebuilds it once refitting has made it too slow.
+    std::string moveSpheres(float time) {
+      for(Sphere& s : spheres) {
+        s.center.s[1] += builtin_scene_bounce(*scene, s, time) - builtin_scene_bounce(*scene, s, sceneTime);
+        s.updateBBox();
+      }
+      sceneTime = time;
+      spheres.writeToDevice();
+
+      if(!refitter) {
+        refitter = std::make_unique<BVHRefitter>(context, queue, device);
+        refitter->setTree(bvhNodes);
+      }
+
+      if(refitter->refit(spheres, bvhNodes)) {
+        std::cerr << "The refitted BVH got too slow, rebuilding it.\n";
+        std::vector<Sphere> sphereList(spheres.begin(), spheres.end());
+        return buildTree(sphereList);
+      } else if(derivedLayout()) {
+        bvhNodes.readFromDevice();
+        return deriveNodes();
+      }
+      return "";
+    }
+
+    // Whether the device can take a job of this size at all. Checked before
+    // anything is allocated for it.
+    std::string checkLimits(int width, int height, int samples, int depth) const {
+      if((size_t)width > maxImageWidth || (size_t)height > maxImageHeight) {
+        return fmt("at most %zux%zu pixels", maxImageWidth, maxImageHeight);
+      }
+      if((cl_ulong)width * height * RGBA_CHANNELS * sizeof(float) > maxAllocSize) {
+        return fmt("%dx%d pixels don't fit in one allocation of the device", width, height);
+      }
+      if(samples > maxSamples) return fmt("at most %d samples per pixel", maxSamples);
+      if(depth > maxDepth) return fmt("at most depth %d", maxDepth);
+      return "";
+    }
+
+    // A black image of the size. It, and what resolves and writes it, are only
+    // made again when the size changes.
+    std::string prepareImage(int width, int height) {
+      if(!image || image->width != width || image->height != height) {
+        image.reset();
+
+        cl_int err;
+        image = std::make_unique<PPMImage>(queue, context, width, height, f3(0.0f), &err);
+        if(err == CL_SUCCESS) {
+          if(resolve) resolve->setImage(context, image->clImage, width, height, &err);
+          else        resolve = std::make_unique<ImageResolve>(context, queue, device, image->clImage, width, height, 3, &err);
+        }
+        if(err != CL_SUCCESS) {
+          // Made again by the next job.
+          image.reset();
+          return clFailure("allocating the image", err);
+        }
+        writer = std::make_unique<ImageWriter>(width, height);
+      }
+
+      const cl_float4 black = {};
+      const std::array<size_t, 3> origin = {0, 0, 0};
+      const std::array<size_t, 3> region = {(size_t)width, (size_t)height, 1};
+      return clFailure("clearing the image",
+                       clEnqueueFillImage(queue, image->clImage, &black, origin.data(), region.data(), 0, nullptr, nullptr));
+    }
+
+  public:
+    // `defines` are CRT's kernel defines. `maxSamples` caps the samples of
+    // a job, at most `maxSamplesPerPixel`.
+    RenderServer(cl_context& context, cl_command_queue& queue, cl_device_id& device, const std::vector<std::string>& defines,
+                 const BVHBuildOptions& bvhOptions, int samplesPerLaunch, int maxSamples)
+      : context(context), queue(queue), device(device), bvhOptions(bvhOptions), samplesPerLaunch(samplesPerLaunch),
+        maxSamples(maxSamples), spheres(context, queue), lambertians(context, queue), metals(context, queue),
+        dielectrics(context, queue), textures(context, queue), bvhNodes(context, queue)
+    {
+      kernel = kernelFromFile("src/kernels/test_kernel.cl", context, device, {"./src"}, defines);
+
+      clErr(clGetDeviceInfo(device, CL_DEVICE_IMAGE2D_MAX_WIDTH, sizeof(maxImageWidth), &maxImageWidth, nullptr));
+      clErr(clGetDeviceInfo(device, CL_DEVICE_IMAGE2D_MAX_HEIGHT, sizeof(maxImageHeight), &maxImageHeight, nullptr));
+      clErr(clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAllocSize), &maxAllocSize, nullptr));
+    }
+
+    ~RenderServer() {
+      clReleaseKernel(kernel);
+      if(derivedNodes != nullptr) clReleaseMemObject(derivedNodes);
+      for(cl_mem m : {spheres.devBuffer(), lambertians.devBuffer(), metals.devBuffer(), dielectrics.devBuffer(),
+                      textures.devBuffer(), bvhNodes.devBuffer()}) {
+        if(m != nullptr) clReleaseMemObject(m);
+      }
+    }
+
+    RenderServer(const RenderServer&) = delete;
+    RenderServer& operator=(const RenderServer&) = delete;
+
+    // Renders `job` and writes its image. Returns what went wrong, empty if
+    // nothing did.
+    std::string render(const RenderJob& job) {
+      if(job.scene != 0 && job.scene != 1) return fmt("no scene %d", job.scene);
+      std::string error;
+      if(!scene || *scene != job.scene) error = loadScene(job.scene);
+      if(error.empty() && job.time.value_or(0) != sceneTime) error = moveSpheres(job.time.value_or(0));
+      if(!error.empty()) {
+        // Whatever is loaded can't be rendered, the next job starts over.
+        scene.reset();
+        return error;
+      }
+
+      int width = job.width.value_or(sceneWidth);
+      int height = job.height.value_or(sceneHeight);
+      int samples = job.samples.value_or(sceneSamples);
+      int depth = job.maxDepth.value_or(sceneDepth);
+      error = checkLimits(width, height, samples, depth);
+      if(!error.empty()) return error;
+
+      Camera camera = sceneCamera;
+      camera.lookfrom = job.lookfrom.value_or(camera.lookfrom);
+      camera.lookat = job.lookat.value_or(camera.lookat);
+      camera.vup = job.vup.value_or(camera.vup);
+      camera.vfov = job.vfov.value_or(camera.vfov);
+      camera.aperature = job.aperture.value_or(camera.aperature);
+      camera.focus_dist = job.focusDist.value_or(camera.focus_dist);
+      camera.initialize((float)width / height);
+
+      error = prepareImage(width, height);
+      if(!error.empty()) return error;
+
+      kernelParameters(kernel, 0, image->clImage, spheres, spheres.count(), traversalNodes, traversalNodeCount, depth,
+                       lambertians, metals, dielectrics, textures, camera);
+
+      const std::array<size_t, 2> imageSize{(size_t)width, (size_t)height};
+      const std::array<size_t, 2> localSize{16, 16};
+      for(int done = 0; done < samples; done += samplesPerLaunch) {
+        kernelParameters(kernel, 11, std::min(samplesPerLaunch, samples - done));
+        cl_int err = clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, imageSize.data(), localSize.data(), 0, nullptr, nullptr);
+        if(err != CL_SUCCESS) return clFailure("launching the kernel", err);
+      }
+      // What went wrong while the launches ran shows up here.
+      error = clFailure("rendering", clFinish(queue));
+      if(!error.empty()) return error;
+
+      ImageFormat format = job.format.value_or(imageFormatFromPath(job.output));
+      bool written;
+      cl_int err;
+      if(imageFormatIsHdr(format)) {
+        image->read_from_device(&err);
+        if(err != CL_SUCCESS) return clFailure("reading the image", err);
+        written = writer->write(job.output, format, image->pixels(), samples);
+      } else {
+        std::vector<u8> pixels = resolve->resolve(samples, &err);
+        if(err != CL_SUCCESS) return clFailure("resolving the image", err);
+        written = writer->write(job.output, format, pixels);
+      }
+
+      return written ? "" : fmt("couldn't write %s", job.output.c_str());
+    }
+
+    // Renders a job per line of `in` until it ends, and answers each on `out`
+    // with "ok <output> <ms>" or "error <what>". Empty lines and lines
+    // starting with # are skipped.
+    void serve(FILE* in, FILE* out) {
+      char* line = nullptr;
+      size_t capacity = 0;
+      ssize_t length;
+
+      while((length = getline(&line, &capacity, in)) != -1) {
+        std::string text(line, length);
+        while(!text.empty() && (text.back() == '\n' || text.back() == '\r')) text.pop_back();
+        if(text.find_first_not_of(" \t") == std::string::npos || text[text.find_first_not_of(" \t")] == '#') continue;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        std::string error;
+        auto job = RenderJob::parse(text, error);
+        if(job) error = render(*job);
+        auto time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() / 1000.0;
+
+        if(error.empty()) fprintf(out, "ok %s %.1f\n", job->output.c_str(), time);
+        else              fprintf(out, "error %s\n", error.c_str());
+        fflush(out);
+      }
+
+      free(line);
+    }
+
+    // Serves one connection at a time on a Unix socket at `path`, the same
+    // way as `serve`. Only returns if the socket fails.
+    bool serveSocket(const std::string& path) {
+      sockaddr_un address = {};
+      address.sun_family = AF_UNIX;
+      if(path.size() >= sizeof(address.sun_path)) {
+        std::cerr << fmt("The socket path %s is too long.\n", path.c_str());
+        return false;
+      }
+      strcpy(address.sun_path, path.c_str());
+
+      int server = socket(AF_UNIX, SOCK_STREAM, 0);
+      unlink(path.c_str());
+      if(server < 0 || bind(server, (sockaddr*)&address, sizeof(address)) != 0 || listen(server, 16) != 0) {
+        std::cerr << fmt("Couldn't listen on %s: %s\n", path.c_str(), strerror(errno));
+        if(server >= 0) close(server);
+        return false;
+      }
+      std::cerr << fmt("Listening on %s\n", path.c_str());
+
+      // A client that hangs up early shouldn't take the server with it.
+      signal(SIGPIPE, SIG_IGN);
+
+      while(true) {
+        int client = accept(server, nullptr, nullptr);
+        if(client < 0) {
+          if(errno == EINTR) continue;
+          std::cerr << fmt("Couldn't accept on %s: %s\n", path.c_str(), strerror(errno));
+          break;
+        }
+
+        // Separate streams, one FILE can't switch between reading and writing freely.
+        FILE* in = fdopen(client, "r");
+        FILE* out = fdopen(dup(client), "w");
+        serve(in, out);
+        fclose(in);
+        fclose(out);
+      }
+
+      close(server);
+      unlink(path.c_str());
+      return false;
+    }
+};
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common/bvh_node.h"
+#include "common/dielectric.h"
+#include "common/lambertian.h"
+#include "common/metal.h"
+#include "common/sphere.h"
+#include "common/texture.h"
+#include "host/BVH.h"
+#include "host/Hash.h"
+
+// Keeps built BVHs on disk, keyed by a hash of the scene (spheres, materials
+// and textures) and of the options that change the tree. On a hit the file
+// is memory mapped and the device buffers are created straight from the
+// mapping instead of building.
+//
+// File layout: `Header`, `nodeCount` BVHNodes, then `sphereCount` Spheres in
+// the order the builder left them, which is the order the leaves expect.
+class SceneCache {
+  private:
+    struct alignas(64) Header {
+      char magic[8];
+      uint64_t key;
+      uint32_t nodeCount, sphereCount;
+      // Catches struct layout changes that the key doesn't.
+      uint32_t nodeSize, sphereSize;
+    };
+
+    static constexpr char magic[8] = "CRTBVH1";
+
+    std::filesystem::path path;
+    uint64_t key;
+
+    static void addMaterialId(Hash& hash, const MaterialId& id) {
+      hash.add(id.material_type).add(id.material_instance).add(id.texture_index);
+    }
+
+    static Hash sceneKey(const BVHBuildOptions& options) {
+      Hash hash;
+      addScene(hash);
+
+      // The thread count doesn't change the tree.
+      hash.add(options.strategy).add(options.binCount).add(options.layout);
+
+      return hash;
+    }
+
+  public:
+    static void addFloat3(Hash& hash, const float3& v) {
+      hash.add(v.s[0]).add(v.s[1]).add(v.s[2]);
+    }
+
+    // Adds the spheres, materials and textures to `hash`. Field by field, the
+    // structs have padding.
+    static void addScene(Hash& hash) {
+      hash.add(Sphere::instances.size());
+      for(const Sphere& s : Sphere::instances) {
+        addFloat3(hash, s.center);
+        hash.add(s.radius);
+        addMaterialId(hash, s.mat_id);
+      }
+
+      hash.add(Lambertian::instances.size());
+      for(const Lambertian& l : Lambertian::instances) addMaterialId(hash, l.id);
+
+      hash.add(Metal::instances.size());
+      for(const Metal& m : Metal::instances) {
+        addFloat3(hash, m.albedo);
+        hash.add(m.fuzz);
+        addMaterialId(hash, m.id);
+      }
+
+      hash.add(Dielectric::instances.size());
+      for(const Dielectric& d : Dielectric::instances) {
+        hash.add(d.ir);
+        addMaterialId(hash, d.id);
+      }
+
+      hash.add(Texture::instances.size());
+      for(const Texture& t : Texture::instances) {
+        hash.add(t.type);
+        if(t.type == TextureSolidColor) {
+          addFloat3(hash, t.as_solid_color);
+        } else {
+          const struct CheckerTexture& c = t.as_checker_texture;
+          hash.add(c.inv_scale).add(c.even_texture_index).add(c.odd_texture_index);
+        }
+      }
+    }
+
+    // A read-only mapping of a cache file, unmapped when destroyed.
+    class Entry {
+      private:
+        void* data;
+        size_t size;
+
+      public:
+        Entry(void* data, size_t size) : data(data), size(size) {}
+        ~Entry() { munmap(data, size); }
+
+        Entry(const Entry&) = delete;
+        Entry& operator=(const Entry&) = delete;
+
+        const Header& header() const { return *static_cast<const Header*>(data); }
+        const BVHNode* nodes() const { return reinterpret_cast<const BVHNode*>(static_cast<char*>(data) + sizeof(Header)); }
+        const Sphere* spheres() const { return reinterpret_cast<const Sphere*>(nodes() + header().nodeCount); }
+        uint nodeCount() const { return header().nodeCount; }
+        uint sphereCount() const { return header().sphereCount; }
+    };
+
+    const std::filesystem::path& file() const { return path; }
+
+    // Hashes the current scene, so call it before building reorders the spheres.
+    SceneCache(const std::string& directory, const BVHBuildOptions& options) {
+      Hash hash = sceneKey(options);
+      key = hash.get();
+      path = std::filesystem::path(directory) / (hash.hex() + ".bvh");
+    }
+
+    // nullptr on a miss, or if the file doesn't look like one we wrote.
+    // Only maps the file, its pages are read when the upload touches them.
+    std::unique_ptr<Entry> load() const {
+      int fd = open(path.c_str(), O_RDONLY);
+      if(fd < 0) return nullptr;
+
+      struct stat st;
+      if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+        close(fd);
+        return nullptr;
+      }
+
+      size_t size = st.st_size;
+      void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if(data == MAP_FAILED) return nullptr;
+
+      auto entry = std::make_unique<Entry>(data, size);
+      const Header& h = entry->header();
+      bool valid = std::equal(magic, magic + sizeof(magic), h.magic)
+        && h.key == key
+        && h.nodeSize == sizeof(BVHNode) && h.sphereSize == sizeof(Sphere)
+        && size == sizeof(Header) + (size_t)h.nodeCount * sizeof(BVHNode) + (size_t)h.sphereCount * sizeof(Sphere);
+
+      if(!valid) {
+        std::cerr << fmt("Ignoring invalid BVH cache file %s.\n", path.c_str());
+        return nullptr;
+      }
+
+      return entry;
+    }
+
+    // Failing to write the cache only costs a rebuild next time, so errors are
+    // reported but not fatal.
+    void store(const BVHNode* nodes, uint nodeCount, const std::vector<Sphere>& spheres) const {
+      std::error_code err;
+      std::filesystem::create_directories(path.parent_path(), err);
+
+      Header h = {};
+      std::copy(magic, magic + sizeof(magic), h.magic);
+      h.key = key;
+      h.nodeCount = nodeCount;
+      h.sphereCount = spheres.size();
+      h.nodeSize = sizeof(BVHNode);
+      h.sphereSize = sizeof(Sphere);
+
+      // Written next to the final file and renamed, so a crash or a parallel
+      // run never leaves a half written file behind.
+      std::filesystem::path tmpPath = path;
+      tmpPath += fmt(".%d.tmp", getpid());
+
+      std::ofstream out(tmpPath, std::ios::binary);
+      out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+      out.write(reinterpret_cast<const char*>(nodes), (std::streamsize)nodeCount * sizeof(BVHNode));
+      out.write(reinterpret_cast<const char*>(spheres.data()), (std::streamsize)spheres.size() * sizeof(Sphere));
+      out.close();
+
+      if(out) std::filesystem::rename(tmpPath, path, err);
+      if(!out || err) {
+        std::cerr << fmt("Couldn't write the BVH cache to %s.\n", path.c_str());
+        std::filesystem::remove(tmpPath, err);
+      }
+    }
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <chrono>
+#include <vector>
+
+#include "common/bvh_node.h"
+#include "host/CLUtil.h"
+
+// Lays a binary `BVHNode` tree out depth-first and gives every internal node
+// a skip link to the first node after its subtree, see `BVHSkipNode`.
+// Smits, "Efficiency Issues for Ray Tracing", 1998.
+// Children are laid out left first. Leaves keep pointing at the same sphere
+// ranges, so the sphere array is shared with the binary tree.
+class SkipLinkBVH {
+	private:
+		std::vector<BVHSkipNode> nodes;
+
+	public:
+		SkipLinkBVH(const BVHNode* binary, uint binaryNodeCount) {
+			auto start = std::chrono::high_resolution_clock::now();
+
+			// Depth-first order of the binary nodes. Iterative, degenerate
+			// scenes can make the tree far deeper than the call stack allows.
+			std::vector<uint> order;
+			order.reserve(binaryNodeCount);
+			std::vector<uint> pending = { 0 };
+			while(!pending.empty()) {
+				uint index = pending.back();
+				pending.pop_back();
+				order.push_back(index);
+
+				const BVHNode& node = binary[index];
+				if(node.sphere_count == 0) {
+					pending.push_back(node.left_first + 1);
+					pending.push_back(node.left_first);
+				}
+			}
+
+			// Children come after their parent in `order`, so walking it
+			// backwards sizes every subtree before its parent needs it.
+			std::vector<uint> subtreeSize(binaryNodeCount, 1);
+			for(auto it = order.rbegin(); it != order.rend(); it++) {
+				const BVHNode& node = binary[*it];
+				if(node.sphere_count == 0) {
+					subtreeSize[*it] += subtreeSize[node.left_first] + subtreeSize[node.left_first + 1];
+				}
+			}
+
+			nodes.resize(order.size());
+			for(uint i = 0; i < order.size(); i++) {
+				const BVHNode& node = binary[order[i]];
+				nodes[i].bounds = node.bounds;
+				nodes[i].sphere_count = node.sphere_count;
+				nodes[i].first_skip = node.sphere_count > 0 ? node.left_first : i + subtreeSize[order[i]];
+			}
+
+			auto end = std::chrono::high_resolution_clock::now();
+			auto linkTime = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+
+			std::cout << fmt("Added skip links to %zu nodes in %.2f ms.\n", nodes.size(), linkTime);
+		}
+
+		std::vector<BVHSkipNode>& getNodes() { return nodes; }
+};
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "host/CLUtil.h"
+
+// Small work-stealing pool for fork-join style work (BVH builds).
+// Every thread owns a deque: it pushes and pops its own tasks at the back, and
+// steals from the front of the other deques when it runs out.
+// The thread that created the pool gets queue 0 and runs tasks as well while
+// it waits, so a pool of N threads spawns N-1 workers.
+class TaskPool {
+  public:
+    using Task = std::function<void()>;
+
+    explicit TaskPool(uint threadCount) {
+      threadCount = std::max(threadCount, 1u);
+
+      for(uint i = 0; i < threadCount; i++) {
+        queues.push_back(std::make_unique<Queue>());
+      }
+
+      for(uint i = 1; i < threadCount; i++) {
+        workers.emplace_back([this, i] { workerLoop(i); });
+      }
+    }
+
+    ~TaskPool() {
+      {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stop = true;
+      }
+      wakeUp.notify_all();
+
+      for(auto& worker : workers) { worker.join(); }
+    }
+
+    TaskPool(const TaskPool&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+
+    uint threadCount() const { return queues.size(); }
+
+    // Safe to call from inside a running task.
+    void submit(Task task) {
+      Queue& q = *queues[currentQueueIndex()];
+
+      pending++;
+      {
+        std::lock_guard<std::mutex> lock(q.mutex);
+        q.tasks.push_back(std::move(task));
+      }
+      queued++;
+
+      // Taking the lock makes sure a thread can't miss the notification
+      // between checking `queued` and going to sleep.
+      { std::lock_guard<std::mutex> lock(sleepMutex); }
+      wakeUp.notify_one();
+      if(waiters.load() > 0) taskDone.notify_all();
+    }
+
+    // Runs other tasks until `remaining` reaches zero, sleeping while there
+    // are none to take.
+    void waitFor(const std::atomic<uint>& remaining) {
+      uint self = currentQueueIndex();
+      while(remaining.load() > 0) {
+        if(tryRunOne(self)) continue;
+
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        waiters++;
+        taskDone.wait(lock, [&] { return remaining.load() == 0 || queued.load() > 0; });
+        waiters--;
+      }
+    }
+
+    // Runs tasks until every submitted task (and whatever they submitted) is done.
+    void waitIdle() { waitFor(pending); }
+
+    // Calls fn(i) for every i in [0, count) and returns once all are done.
+    void parallelFor(uint count, const std::function<void(uint)>& fn) {
+      std::atomic<uint> remaining = count;
+
+      for(uint i = 0; i < count; i++) {
+        submit([&fn, &remaining, i] {
+          fn(i);
+          remaining--;
+        });
+      }
+
+      waitFor(remaining);
+    }
+
+  private:
+    struct Queue {
+      std::mutex mutex;
+      std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+
+    // Submitted and not finished, and of those, not yet taken off a queue.
+    std::atomic<uint> pending = 0, queued = 0;
+    bool stop = false;
+    std::mutex sleepMutex;
+    // Workers sleep on `wakeUp`, threads in `waitFor` on `taskDone`.
+    std::condition_variable wakeUp, taskDone;
+    std::atomic<uint> waiters = 0;
+
+    inline static thread_local const TaskPool* currentPool = nullptr;
+    inline static thread_local uint currentIndex = 0;
+
+    uint currentQueueIndex() const {
+      return currentPool == this ? currentIndex : 0;
+    }
+
+    bool tryRunOne(uint self) {
+      Task task;
+
+      {
+        Queue& own = *queues[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if(!own.tasks.empty()) {
+          task = std::move(own.tasks.back());
+          own.tasks.pop_back();
+        }
+      }
+
+      for(uint offset = 1; !task && offset < queues.size(); offset++) {
+        Queue& victim = *queues[(self + offset) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if(!victim.tasks.empty()) {
+          task = std::move(victim.tasks.front());
+          victim.tasks.pop_front();
+        }
+      }
+
+      if(!task) return false;
+      queued--;
+
+      task();
+      pending--;
+
+      // Whatever `waitFor` waits on may have just reached zero.
+      if(waiters.load() > 0) {
+        { std::lock_guard<std::mutex> lock(sleepMutex); }
+        taskDone.notify_all();
+      }
+      return true;
+    }
+
+    void workerLoop(uint self) {
+      currentPool = this;
+      currentIndex = self;
+
+      while(true) {
+        if(tryRunOne(self)) continue;
+
+        // Sleep until something is submitted. Running tasks submit what
+        // they spawn, so there's no need to poll for it.
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wakeUp.wait(lock, [this] { return stop || queued.load() > 0; });
+        if(stop) return;
+      }
+    }
+};
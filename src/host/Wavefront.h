@@ -0,0 +1,203 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <string>
+#include <vector>
+
+#include "common/camera.h"
+#include "common/dielectric.h"
+#include "common/lambertian.h"
+#include "common/metal.h"
+#include "common/path_state.h"
+#include "common/sphere.h"
+#include "common/texture.h"
+#include "host/CLBuffer.h"
+#include "host/CLKernel.h"
+#include "host/CLUtil.h"
+
+// Drives the wavefront integrator, see `kernels/wavefront.cl`. Renders the
+// same image as test_kernel.cl with one kernel per stage instead of one per
+// sample, so work-items in a launch run the same code: extension only
+// traverses the BVH, and each material is shaded by its own kernel.
+// `sortHits` also sorts the hits by material instance before shading, see
+// WF_SORT_HITS.
+class Wavefront {
+  private:
+    cl_context context;
+    cl_command_queue queue;
+    cl_device_id device;
+
+    cl_program program;
+    cl_kernel generate, extend, shadeLambertian, shadeMetal, shadeDielectric, accumulate;
+    cl_kernel sortScan = nullptr, sortScatter = nullptr;
+
+    uint pathCount;
+    int maxDepth;
+    bool sortHits;
+
+    cl_mem paths, rayQueues[2], materialQueues, counters;
+    cl_mem hitQueue = nullptr, hitKeys = nullptr, keyBins = nullptr, keyBases = nullptr;
+    uint keyCount = 0;
+
+    static constexpr size_t groupSize = 64;
+    static constexpr size_t scanGroupSize = 256;
+
+    cl_kernel createKernel(const char* name) {
+      cl_int err;
+      cl_kernel kernel = clCreateKernel(program, name, &err);
+      clErr(err);
+      return kernel;
+    }
+
+    cl_mem createScratch(size_t bytes) {
+      cl_int err;
+      cl_mem buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, nullptr, &err);
+      clErr(err);
+      return buffer;
+    }
+
+    // Every stage runs over all paths, work-items past the queue size exit.
+    void enqueue(cl_kernel kernel) {
+      size_t globalSize = (pathCount + groupSize - 1) / groupSize * groupSize;
+      clErr(clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &globalSize, &groupSize, 0, nullptr, nullptr));
+    }
+
+  public:
+    // `defines` are the same as for the megakernel, they pick the BVH node format.
+    Wavefront(cl_context& context, cl_command_queue& queue, cl_device_id& device,
+              std::vector<std::string> defines, uint width, uint height, int maxDepth, bool sortHits)
+      : context(context), queue(queue), device(device),
+        pathCount(width * height), maxDepth(std::min(maxDepth, WF_MAX_DEPTH)),
+        sortHits(sortHits)
+    {
+      if(sortHits) defines.push_back("WF_SORT_HITS");
+      program = buildProgram("src/kernels/wavefront.cl", context, device, {"./src"}, defines);
+
+      generate        = createKernel("wf_generate");
+      extend          = createKernel("wf_extend");
+      shadeLambertian = createKernel("wf_shade_lambertian");
+      shadeMetal      = createKernel("wf_shade_metal");
+      shadeDielectric = createKernel("wf_shade_dielectric");
+      accumulate      = createKernel("wf_accumulate");
+
+      paths          = createScratch(pathCount * sizeof(PathState));
+      rayQueues[0]   = createScratch(pathCount * sizeof(uint));
+      rayQueues[1]   = createScratch(pathCount * sizeof(uint));
+      materialQueues = createScratch(WF_MATERIAL_TYPES * pathCount * sizeof(uint));
+      counters       = createScratch(WF_COUNTER_COUNT * sizeof(uint));
+
+      if(sortHits) {
+        sortScan    = createKernel("wf_sort_scan");
+        sortScatter = createKernel("wf_sort_scatter");
+        hitQueue    = createScratch(pathCount * sizeof(uint));
+        hitKeys     = createScratch(pathCount * sizeof(uint));
+        keyBases    = createScratch((WF_MATERIAL_TYPES + 1) * sizeof(uint));
+      }
+    }
+
+    ~Wavefront() {
+      for(cl_kernel k : {generate, extend, shadeLambertian, shadeMetal, shadeDielectric, accumulate}) {
+        clReleaseKernel(k);
+      }
+      for(cl_mem m : {paths, rayQueues[0], rayQueues[1], materialQueues, counters}) {
+        clReleaseMemObject(m);
+      }
+      if(sortHits) {
+        clReleaseKernel(sortScan);
+        clReleaseKernel(sortScatter);
+        for(cl_mem m : {hitQueue, hitKeys, keyBases}) clReleaseMemObject(m);
+        if(keyBins) clReleaseMemObject(keyBins);
+      }
+      clReleaseProgram(program);
+    }
+
+    Wavefront(const Wavefront&) = delete;
+    Wavefront& operator=(const Wavefront&) = delete;
+
+    // Sets the arguments that stay the same for every sample. The ray queue
+    // arguments are set per bounce in `enqueueSample`.
+    // `bvhStats` is only passed with -DBVH_STATS.
+    void setScene(cl_mem image, CLBuffer<Sphere>& spheres, cl_mem bvhNodes, uint bvhNodeCount,
+                  CLBuffer<Lambertian>& lambertians, CLBuffer<Metal>& metals, CLBuffer<Dielectric>& dielectrics,
+                  CLBuffer<Texture>& textures, const Camera& camera, CLBuffer<cl_ulong>* bvhStats = nullptr) {
+      kernelParameters(generate, 0, paths);
+      kernelParameters(generate, 2, image, camera);
+
+      kernelParameters(extend, 0, paths);
+      kernelParameters(extend, 2, materialQueues, counters, pathCount, spheres, bvhNodes, bvhNodeCount);
+      uint statsIndex = 8;
+
+      if(sortHits) {
+        // One key per material instance, grouped by type.
+        std::array<uint, WF_MATERIAL_TYPES + 1> bases;
+        bases[MATERIAL_LAMBERTIAN] = 0;
+        bases[MATERIAL_METAL]      = lambertians.count();
+        bases[MATERIAL_DIELECTRIC] = bases[MATERIAL_METAL] + metals.count();
+        bases[WF_MATERIAL_TYPES]   = bases[MATERIAL_DIELECTRIC] + dielectrics.count();
+        clErr(clEnqueueWriteBuffer(queue, keyBases, CL_TRUE, 0, sizeof(bases), bases.data(), 0, nullptr, nullptr));
+
+        keyCount = bases[WF_MATERIAL_TYPES];
+        if(keyBins) clReleaseMemObject(keyBins);
+        keyBins = createScratch(std::max(keyCount, 1u) * sizeof(uint));
+
+        kernelParameters(extend, statsIndex, hitQueue, hitKeys, keyBins, keyBases);
+        statsIndex += 4;
+
+        kernelParameters(sortScan, 0, keyBins, keyBases, counters);
+        clErr(clSetKernelArg(sortScan, 3, scanGroupSize * sizeof(uint), nullptr));
+        kernelParameters(sortScatter, 0, hitQueue, hitKeys, keyBins, materialQueues, counters);
+      }
+
+      if(bvhStats) kernelParameters(extend, statsIndex, *bvhStats);
+
+      kernelParameters(shadeLambertian, 0, paths, materialQueues);
+      kernelParameters(shadeLambertian, 3, counters, pathCount, maxDepth, textures);
+      kernelParameters(shadeMetal, 0, paths, materialQueues);
+      kernelParameters(shadeMetal, 3, counters, pathCount, maxDepth, metals);
+      kernelParameters(shadeDielectric, 0, paths, materialQueues);
+      kernelParameters(shadeDielectric, 3, counters, pathCount, maxDepth, dielectrics);
+
+      kernelParameters(accumulate, 0, image, paths);
+    }
+
+    // Enqueues one sample per pixel without waiting for it.
+    void enqueueSample() {
+      const uint zero = 0;
+
+      kernelParameters(generate, 1, rayQueues[0]);
+      enqueue(generate);
+      clErr(clEnqueueFillBuffer(queue, counters, &pathCount, sizeof(uint), WF_RAY_COUNT * sizeof(uint), sizeof(uint), 0, nullptr, nullptr));
+
+      for(int bounce = 0; bounce < maxDepth - 1; bounce++) {
+        cl_mem rays = rayQueues[bounce % 2], nextRays = rayQueues[1 - bounce % 2];
+
+        // Everything but WF_RAY_COUNT starts empty.
+        clErr(clEnqueueFillBuffer(queue, counters, &zero, sizeof(uint), WF_NEXT_RAY_COUNT * sizeof(uint),
+                                  (WF_COUNTER_COUNT - WF_NEXT_RAY_COUNT) * sizeof(uint), 0, nullptr, nullptr));
+
+        if(sortHits && keyCount > 0) {
+          clErr(clEnqueueFillBuffer(queue, keyBins, &zero, sizeof(uint), 0, keyCount * sizeof(uint), 0, nullptr, nullptr));
+        }
+
+        kernelParameters(extend, 1, rays);
+        enqueue(extend);
+
+        if(sortHits) {
+          size_t scanSize = scanGroupSize;
+          clErr(clEnqueueNDRangeKernel(queue, sortScan, 1, nullptr, &scanSize, &scanSize, 0, nullptr, nullptr));
+          enqueue(sortScatter);
+        }
+
+        for(cl_kernel shade : {shadeLambertian, shadeMetal, shadeDielectric}) {
+          kernelParameters(shade, 2, nextRays);
+          enqueue(shade);
+        }
+
+        clErr(clEnqueueCopyBuffer(queue, counters, counters, WF_NEXT_RAY_COUNT * sizeof(uint), WF_RAY_COUNT * sizeof(uint),
+                                  sizeof(uint), 0, nullptr, nullptr));
+      }
+
+      enqueue(accumulate);
+    }
+};
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "common/bvh_node.h"
+#include "common/bvh_wide_node.h"
+#include "host/CLUtil.h"
+
+// Collapses a binary `BVHNode` tree into a `Width`-wide one (BVH4Node or
+// BVH8Node). Each wide node starts with one binary node and keeps opening its
+// internal child with the largest surface area until it has `Width` children
+// or only leaves are left. Leaves keep pointing at the same sphere ranges, so
+// the sphere array is shared with the binary tree.
+//
+// `compress()` turns the result into `CompressedNode`s with the same indices.
+template<typename Node, typename CompressedNode, int Width>
+class WideBVH {
+	private:
+		std::vector<Node> nodes;
+		const BVHNode* binary;
+		// Most entries the traversal stack holds at once.
+		uint stackSize = 0;
+
+		// Biased exponent of the smallest power of two step that covers
+		// [lo, hi] in 255 steps.
+		static uint8_t gridExponent(float lo, float hi) {
+			int e = hi > lo ? (int)std::ceil(std::log2((hi - lo) / 255.0f)) : -126;
+			e = std::max(e, -126);
+			// log2 may round down by one.
+			while(lo + 255.0f * std::ldexp(1.0f, e) < hi) e++;
+			return e + 127;
+		}
+
+		// Same math as the decoding in `bvh_wide_child_bounds`, so the checks
+		// hold on the device too.
+		static uint8_t quantizeMin(float v, float origin, float step) {
+			int q = std::clamp((int)std::floor((v - origin) / step), 0, 255);
+			while(q > 0 && origin + q * step > v) q--;
+			return q;
+		}
+
+		static uint8_t quantizeMax(float v, float origin, float step) {
+			int q = std::clamp((int)std::ceil((v - origin) / step), 0, 255);
+			while(q < 255 && origin + q * step < v) q++;
+			return q;
+		}
+
+		static void compressNode(const Node& node, CompressedNode& out) {
+			float lo[3] = { INFINITY, INFINITY, INFINITY }, hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+			for(int slot = 0; slot < Width; slot++) {
+				if(node.child.s[slot] == BVH_WIDE_EMPTY) continue;
+				lo[0] = std::min(lo[0], node.min_x.s[slot]); hi[0] = std::max(hi[0], node.max_x.s[slot]);
+				lo[1] = std::min(lo[1], node.min_y.s[slot]); hi[1] = std::max(hi[1], node.max_y.s[slot]);
+				lo[2] = std::min(lo[2], node.min_z.s[slot]); hi[2] = std::max(hi[2], node.max_z.s[slot]);
+			}
+
+			out.origin_x = lo[0]; out.origin_y = lo[1]; out.origin_z = lo[2];
+			float step[3];
+			for(int axis = 0; axis < 3; axis++) {
+				out.exponent.s[axis] = gridExponent(lo[axis], hi[axis]);
+				step[axis] = std::ldexp(1.0f, out.exponent.s[axis] - 127);
+			}
+			out.exponent.s[3] = 0;
+
+			for(int slot = 0; slot < Width; slot++) {
+				out.child.s[slot] = node.child.s[slot];
+				assert(node.count.s[slot] <= UINT16_MAX && "Leaf too large for a compressed node");
+				out.count.s[slot] = node.count.s[slot];
+
+				if(node.child.s[slot] == BVH_WIDE_EMPTY) {
+					out.lo_x.s[slot] = out.hi_x.s[slot] = 0;
+					out.lo_y.s[slot] = out.hi_y.s[slot] = 0;
+					out.lo_z.s[slot] = out.hi_z.s[slot] = 0;
+					continue;
+				}
+
+				out.lo_x.s[slot] = quantizeMin(node.min_x.s[slot], lo[0], step[0]);
+				out.hi_x.s[slot] = quantizeMax(node.max_x.s[slot], lo[0], step[0]);
+				out.lo_y.s[slot] = quantizeMin(node.min_y.s[slot], lo[1], step[1]);
+				out.hi_y.s[slot] = quantizeMax(node.max_y.s[slot], lo[1], step[1]);
+				out.lo_z.s[slot] = quantizeMin(node.min_z.s[slot], lo[2], step[2]);
+				out.hi_z.s[slot] = quantizeMax(node.max_z.s[slot], lo[2], step[2]);
+			}
+		}
+
+		void setSlot(uint wideIndex, int slot, const AABB& bounds, uint child, uint count) {
+			Node& node = nodes[wideIndex];
+			node.min_x.s[slot] = bounds.x.min; node.max_x.s[slot] = bounds.x.max;
+			node.min_y.s[slot] = bounds.y.min; node.max_y.s[slot] = bounds.y.max;
+			node.min_z.s[slot] = bounds.z.min; node.max_z.s[slot] = bounds.z.max;
+			node.child.s[slot] = child;
+			node.count.s[slot] = count;
+		}
+
+		// `pending` entries are on the traversal stack when this node is
+		// reached, it pushes its children but the nearest.
+		void collapse(uint binaryIndex, uint wideIndex, uint pending) {
+			std::vector<uint> children = { binaryIndex };
+
+			while(children.size() < Width) {
+				int largest = -1;
+				float largestArea = -1;
+				for(size_t i = 0; i < children.size(); i++) {
+					const BVHNode& c = binary[children[i]];
+					if(c.sphere_count == 0 && c.bounds.area() > largestArea) {
+						largest = i;
+						largestArea = c.bounds.area();
+					}
+				}
+				if(largest == -1) break;
+
+				uint opened = children[largest];
+				children[largest] = binary[opened].left_first;
+				children.push_back(binary[opened].left_first + 1);
+			}
+
+			for(int slot = 0; slot < Width; slot++) {
+				setSlot(wideIndex, slot, AABB(), BVH_WIDE_EMPTY, 0);
+			}
+
+			// Fill in every slot before recursing, `nodes` may reallocate.
+			std::vector<std::pair<uint, uint>> innerChildren;
+			for(size_t slot = 0; slot < children.size(); slot++) {
+				const BVHNode& c = binary[children[slot]];
+
+				if(c.sphere_count > 0) {
+					setSlot(wideIndex, slot, c.bounds, c.left_first, c.sphere_count);
+				} else {
+					uint childIndex = nodes.size();
+					nodes.emplace_back();
+					setSlot(wideIndex, slot, c.bounds, childIndex, 0);
+					innerChildren.emplace_back(children[slot], childIndex);
+				}
+			}
+
+			pending += children.size() - 1;
+			stackSize = std::max(stackSize, pending);
+			for(auto [childBinary, childWide] : innerChildren) {
+				collapse(childBinary, childWide, pending);
+			}
+		}
+
+	public:
+		WideBVH(const BVHNode* binaryPool, uint binaryNodeCount)
+			: binary(binaryPool)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+
+			nodes.reserve(binaryNodeCount / (Width - 1) + 1);
+			nodes.emplace_back();
+			collapse(0, 0, 0);
+
+			auto end = std::chrono::high_resolution_clock::now();
+			auto collapseTime = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+
+			std::cout << fmt("Collapsed %u binary nodes (%zu KiB) into %zu %d-wide nodes (%zu KiB) in %.2f ms.\n",
+					binaryNodeCount, binaryNodeCount * sizeof(BVHNode) / 1024,
+					nodes.size(), Width, nodes.size() * sizeof(Node) / 1024,
+					collapseTime);
+		}
+
+		std::vector<Node>& getNodes() { return nodes; }
+
+		// Why the kernels can't traverse the tree, empty if they can. The
+		// stack is sized at build time, a deeper tree would lose nodes.
+		std::string stackError() const {
+			if(stackSize <= BVH_WIDE_STACK_ENTRIES(Width)) return "";
+			return fmt("The %d-wide BVH needs a traversal stack of %u entries, the kernels have %d (BVH_WIDE_STACK_SIZE).",
+					Width, stackSize, BVH_WIDE_STACK_ENTRIES(Width));
+		}
+
+		std::vector<CompressedNode> compress() const {
+			std::vector<CompressedNode> compressed(nodes.size());
+			for(size_t i = 0; i < nodes.size(); i++) {
+				compressNode(nodes[i], compressed[i]);
+			}
+
+			size_t before = nodes.size() * sizeof(Node), after = compressed.size() * sizeof(CompressedNode);
+			std::cout << fmt("Compressed %d-wide nodes from %zu KiB to %zu KiB (%.0f%% saved).\n",
+					Width, before / 1024, after / 1024, 100.0 * (before - after) / before);
+
+			return compressed;
+		}
+};
+
+using BVH4 = WideBVH<BVH4Node, BVH4CompressedNode, 4>;
+using BVH8 = WideBVH<BVH8Node, BVH8CompressedNode, 8>;
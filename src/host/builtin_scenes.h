@@ -21,13 +21,9 @@
 #include <utility>
 #include <chrono>
 
-#include "host/PPM.h"
 #include "host/Utils.h"
-#include "host/CLBuffer.h"
 #include "host/CLMath.h"
 #include "host/Random.h"
-#include "host/BVH.h"
-#include "host/CLKernel.h"
 
 #include "common/sphere.h"
 #include "common/camera.h"
@@ -116,3 +112,42 @@ void two_checkered_spheres(
   Dielectric::push_back({1.5});
   Metal::push_back({f3(0.7, 0.6, 0.5), 0.0});
 }
+
+// How far sphere `s` of builtin scene `scene` has bounced up from where it
+// rests at `time`, for animated renders (see `RenderServer`). The small
+// random spheres bounce, each with its own phase, the rest stay put. The
+// phase only depends on x and z, which bouncing leaves alone, so moving to
+// another time is adding the difference of two bounces.
+float builtin_scene_bounce(int scene, const Sphere& s, float time) {
+  if(scene != 0 || s.radius >= 0.5f) return 0;
+
+  float phase = 0.37f * s.center.s[0] + 0.71f * s.center.s[2];
+  return 0.5f * fabsf(sinf((float)pi * (time + phase)));
+}
+
+// Empties the scene, so another one can be loaded.
+void clear_scene() {
+  Sphere::instances.clear();
+  Lambertian::instances.clear();
+  Metal::instances.clear();
+  Dielectric::instances.clear();
+  Texture::instances.clear();
+}
+
+// Loads builtin scene `scene` into the empty scene, with its camera and
+// render settings. The same scene number always gives the same scene.
+void load_builtin_scene(
+    int scene, Camera& camera,
+    int& imageWidth, int& imageHeight,
+    int& samplesPerPixel, int& maxDepth
+) {
+  srand(42);
+
+  switch(scene) {
+    case 1: 
+      two_checkered_spheres(camera, imageWidth, imageHeight, samplesPerPixel, maxDepth); break;
+    case 0:
+    default:
+      random_spheres(camera, imageWidth, imageHeight, samplesPerPixel, maxDepth);        break;
+  }
+}
@@ -0,0 +1,82 @@
+#include "kernels/test_kernel.cl"
+
+// Adaptive sampling, see host/AdaptiveSampler.h.
+// Only the pixels in `active_pixels` get sampled. Next to the image,
+// `moments` keeps the sum of every pixel's sample luminance and of its
+// square. adaptive_retire then compacts the pixels that haven't converged
+// into the next active list.
+kernel void adaptive_kernel(
+	read_write image2d_t input,
+
+	global Sphere* spheres,
+	int sphere_count,
+
+	global BVHTraversalNode* bvh_nodes,
+	uint bvh_size,
+
+	int max_depth,
+
+	global Lambertian* lambertians,
+	global Metal* metals,
+	global Dielectric* dielectrics,
+
+	global Texture* textures,
+
+	Camera camera,
+	int samples_per_launch,
+
+	global const uint* active_pixels,
+	uint active_count,
+	global float2* moments
+	BVH_STATS_PARAM
+) {
+	uint i = get_global_id(0);
+	if(i >= active_count) return;
+
+	const uint width = get_image_width(input);
+	uint pixel = active_pixels[i];
+	int2 pos = {pixel % width, pixel / width};
+
+	float2 launch_moments;
+	render_pixel(input, pos, samples_per_launch, &launch_moments, spheres, sphere_count, bvh_nodes, bvh_size, max_depth, lambertians, metals, dielectrics, textures, &camera BVH_STATS_ARG);
+
+	moments[pixel] += launch_moments;
+}
+
+// A pixel stays active until it has max_samples, or has at least min_samples
+// and the standard error of its mean luminance drops to `threshold`.
+// The error is taken after the square root the output applies for gamma,
+// d(sqrt(L)) = dL / (2 sqrt(L)), so dark pixels aren't held to a stricter
+// standard than the eye is.
+kernel void adaptive_retire(
+	read_only image2d_t image,
+	global const float2* moments,
+	global const uint* active_pixels,
+	uint active_count,
+	global uint* next_active_pixels,
+	global volatile uint* next_active_count,
+	float threshold,
+	int min_samples,
+	int max_samples
+) {
+	uint i = get_global_id(0);
+	if(i >= active_count) return;
+
+	const uint width = get_image_width(image);
+	uint pixel = active_pixels[i];
+
+	// Alpha counts the samples.
+	float n = read_imagef(image, (int2)(pixel % width, pixel / width)).w;
+	if(n >= max_samples) return;
+
+	if(n >= min_samples) {
+		float2 m = moments[pixel];
+		float mean = m.x / n;
+		float variance = max(m.y / n - mean * mean, 0.0f) * n / max(n - 1, 1.0f);
+		float error = sqrt(variance / n) / (2 * sqrt(max(mean, 1e-4f)));
+
+		if(error <= threshold) return;
+	}
+
+	next_active_pixels[atomic_inc(next_active_count)] = pixel;
+}
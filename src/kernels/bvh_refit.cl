@@ -0,0 +1,99 @@
+#include "common/bvh_node.h"
+#include "common/sphere.h"
+
+// Refitting works on any tree in the `BVHNode` layout, whether it was built
+// on the host or by `lbvh.cl`. See host/BVHRefit.h.
+
+#define NO_PARENT 0xFFFFFFFF
+
+// parents[i]: index of the node whose children include node i.
+// Only depends on the topology, so it's computed once per build.
+kernel void bvh_compute_parents(global const BVHNode* nodes, uint node_count, global uint* parents) {
+	uint i = get_global_id(0);
+	if(i >= node_count) return;
+
+	if(i == 0) parents[0] = NO_PARENT;
+
+	global const BVHNode* node = &nodes[i];
+	if(node->sphere_count == 0 && node->left_first != 0) {
+		parents[node->left_first] = i;
+		parents[node->left_first + 1] = i;
+	}
+}
+
+// One work-item per node, only leaves do any work. Leaves recompute their
+// spheres' boxes from center and radius, then walk up the tree. Like
+// lbvh_fit_bounds, the first one to reach a node stops and the second merges
+// both children. visits must be zeroed.
+kernel void bvh_refit(
+	global Sphere* spheres,
+	global BVHNode* nodes,
+	uint node_count,
+	global const uint* parents,
+	global volatile uint* visits
+) {
+	uint i = get_global_id(0);
+	if(i >= node_count || nodes[i].sphere_count == 0) return;
+
+	AABB bounds;
+	bounds.x = bounds.y = bounds.z = interval_empty();
+
+	for(uint first = nodes[i].left_first, offset = 0; offset < nodes[i].sphere_count; offset++) {
+		global Sphere* s = &spheres[first + offset];
+		float r = s->radius;
+
+		AABB sb;
+		sb.x = interval(s->center.x - r, s->center.x + r);
+		sb.y = interval(s->center.y - r, s->center.y + r);
+		sb.z = interval(s->center.z - r, s->center.z + r);
+
+		s->bbox = sb;
+		bounds = aabb_union(bounds, sb);
+	}
+	nodes[i].bounds = bounds;
+
+	uint node = i;
+	while(parents[node] != NO_PARENT) {
+		uint p = parents[node];
+
+		mem_fence(CLK_GLOBAL_MEM_FENCE);
+		if(atomic_inc(&visits[p]) == 0) return;
+		mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+		uint first_child = nodes[p].left_first;
+		nodes[p].bounds = aabb_union(nodes[first_child].bounds, nodes[first_child + 1].bounds);
+		node = p;
+	}
+}
+
+float aabb_area(AABB b) {
+	float3 e = (float3)(b.x.max - b.x.min, b.y.max - b.y.min, b.z.max - b.z.min);
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+// Same cost as `BVH::sahCost`, minus the division by the root's area which
+// the host does after summing the per work-group partial sums.
+kernel void bvh_sah_cost(
+	global const BVHNode* nodes,
+	uint node_count,
+	global float* partial_costs,
+	local float* scratch
+) {
+	uint i = get_global_id(0);
+	uint lid = get_local_id(0);
+
+	float cost = 0;
+	if(i < node_count) {
+		global const BVHNode* node = &nodes[i];
+		cost = aabb_area(node->bounds) * (node->sphere_count > 0 ? node->sphere_count : 1);
+	}
+	scratch[lid] = cost;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for(uint stride = get_local_size(0) / 2; stride > 0; stride /= 2) {
+		if(lid < stride) scratch[lid] += scratch[lid + stride];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if(lid == 0) partial_costs[get_group_id(0)] = scratch[0];
+}
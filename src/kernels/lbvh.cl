@@ -0,0 +1,286 @@
+#include "common/bvh_node.h"
+#include "common/sphere.h"
+
+// Linear BVH built entirely on the device.
+// Karras, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees", 2012.
+//
+// Pipeline (see host/LBVH.h):
+// 	1. lbvh_centroid_bounds  Bounds of all sphere centers.
+// 	2. lbvh_morton_codes     30 bit Morton code of each center within those bounds.
+// 	3. lbvh_radix_*          Stable LSB radix sort of (code, sphere index) pairs.
+// 	4. lbvh_gather_spheres   Reorders the spheres to match the sorted codes.
+// 	5. lbvh_build_hierarchy  One work-item per internal node, finds its range and split.
+// 	6. lbvh_fit_bounds       One work-item per leaf, walks up and merges bounds.
+//
+// The output uses the same `BVHNode` layout as the host builder, so
+// `bvh_intersect` can't tell the difference. The only extra constraint that
+// layout has over Karras' is that siblings are adjacent. Internal node i keeps
+// its children at slots 2i+1 and 2i+2, and the root lives at slot 0, so the
+// tree takes 2n-1 slots. Every leaf holds exactly one sphere.
+
+#define RADIX_BITS 4
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_TILE 256
+
+// Maps a float to a uint with the same ordering so atomic_min/max work on it.
+uint float_to_ordered(float f) {
+	uint u = as_uint(f);
+	return (u & 0x80000000) ? ~u : (u | 0x80000000);
+}
+
+float ordered_to_float(uint u) {
+	return as_float((u & 0x80000000) ? (u & 0x7FFFFFFF) : ~u);
+}
+
+// Inserts two zero bits between each of the lower 10 bits.
+uint expand_bits(uint v) {
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// bounds: [min_x, min_y, min_z, max_x, max_y, max_z], as ordered uints.
+// Must be initialized to UINT_MAX for the mins and 0 for the maxes.
+kernel void lbvh_centroid_bounds(global const Sphere* spheres, uint sphere_count, global uint* bounds) {
+	uint i = get_global_id(0);
+	if(i >= sphere_count) return;
+
+	float3 c = spheres[i].center;
+	atomic_min(&bounds[0], float_to_ordered(c.x));
+	atomic_min(&bounds[1], float_to_ordered(c.y));
+	atomic_min(&bounds[2], float_to_ordered(c.z));
+	atomic_max(&bounds[3], float_to_ordered(c.x));
+	atomic_max(&bounds[4], float_to_ordered(c.y));
+	atomic_max(&bounds[5], float_to_ordered(c.z));
+}
+
+kernel void lbvh_morton_codes(
+	global const Sphere* spheres,
+	uint sphere_count,
+	global const uint* bounds,
+	global uint* codes,
+	global uint* indices
+) {
+	uint i = get_global_id(0);
+	if(i >= sphere_count) return;
+
+	float3 lo = (float3)(ordered_to_float(bounds[0]), ordered_to_float(bounds[1]), ordered_to_float(bounds[2]));
+	float3 hi = (float3)(ordered_to_float(bounds[3]), ordered_to_float(bounds[4]), ordered_to_float(bounds[5]));
+	float3 extent = fmax(hi - lo, (float3)(1e-20f));
+
+	float3 p = clamp((spheres[i].center - lo) / extent * 1024.0f, 0.0f, 1023.0f);
+
+	codes[i] = (expand_bits((uint)p.x) << 2) | (expand_bits((uint)p.y) << 1) | expand_bits((uint)p.z);
+	indices[i] = i;
+}
+
+// One work-item per tile of RADIX_TILE keys.
+// histogram is laid out as [bucket * tile_count + tile] so an exclusive scan over
+// it directly gives every tile's starting offset per bucket.
+kernel void lbvh_radix_histogram(
+	global const uint* keys,
+	uint count,
+	uint shift,
+	global uint* histogram
+) {
+	uint tile = get_global_id(0);
+	uint tile_count = (count + RADIX_TILE - 1) / RADIX_TILE;
+	if(tile >= tile_count) return;
+
+	uint local_histogram[RADIX_BUCKETS];
+	for(uint b = 0; b < RADIX_BUCKETS; b++) local_histogram[b] = 0;
+
+	uint end = min(count, (tile + 1) * RADIX_TILE);
+	for(uint i = tile * RADIX_TILE; i < end; i++) {
+		local_histogram[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+	}
+
+	for(uint b = 0; b < RADIX_BUCKETS; b++) {
+		histogram[b * tile_count + tile] = local_histogram[b];
+	}
+}
+
+// Exclusive scan of the histogram, in place.
+// The histogram has RADIX_BUCKETS * (count / RADIX_TILE) entries, which stays
+// small enough (64k for 1M spheres) for a single work-group.
+kernel void lbvh_radix_scan(global uint* histogram, uint histogram_size, local uint* partial_sums) {
+	uint lid = get_local_id(0);
+	uint group_size = get_local_size(0);
+
+	uint per_item = (histogram_size + group_size - 1) / group_size;
+	uint first = lid * per_item;
+	uint end = min(histogram_size, first + per_item);
+
+	uint sum = 0;
+	for(uint i = first; i < end; i++) sum += histogram[i];
+	partial_sums[lid] = sum;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint offset = 0;
+	for(uint i = 0; i < lid; i++) offset += partial_sums[i];
+
+	for(uint i = first; i < end; i++) {
+		uint value = histogram[i];
+		histogram[i] = offset;
+		offset += value;
+	}
+}
+
+// Walks each tile in order so the sort stays stable.
+kernel void lbvh_radix_scatter(
+	global const uint* keys_in,
+	global const uint* values_in,
+	uint count,
+	uint shift,
+	global const uint* offsets,
+	global uint* keys_out,
+	global uint* values_out
+) {
+	uint tile = get_global_id(0);
+	uint tile_count = (count + RADIX_TILE - 1) / RADIX_TILE;
+	if(tile >= tile_count) return;
+
+	uint local_offsets[RADIX_BUCKETS];
+	for(uint b = 0; b < RADIX_BUCKETS; b++) local_offsets[b] = offsets[b * tile_count + tile];
+
+	uint end = min(count, (tile + 1) * RADIX_TILE);
+	for(uint i = tile * RADIX_TILE; i < end; i++) {
+		uint key = keys_in[i];
+		uint dst = local_offsets[(key >> shift) & (RADIX_BUCKETS - 1)]++;
+		keys_out[dst] = key;
+		values_out[dst] = values_in[i];
+	}
+}
+
+kernel void lbvh_gather_spheres(
+	global const Sphere* spheres_in,
+	global const uint* sorted_indices,
+	uint sphere_count,
+	global Sphere* spheres_out
+) {
+	uint i = get_global_id(0);
+	if(i >= sphere_count) return;
+
+	spheres_out[i] = spheres_in[sorted_indices[i]];
+}
+
+// Length of the longest common prefix of codes i and j, -1 if j is out of range.
+// Duplicate codes fall back to comparing the indices.
+int lbvh_delta(global const uint* codes, int n, int i, int j) {
+	if(j < 0 || j >= n) return -1;
+
+	uint a = codes[i], b = codes[j];
+	if(a == b) return 32 + clz((uint)(i ^ j));
+	return clz(a ^ b);
+}
+
+// internal_slot[i]: slot of internal node i in the node pool.
+// parent[slot]: internal node that owns the node at `slot`.
+// leaf_slot[k]: slot of the leaf holding (sorted) sphere k.
+kernel void lbvh_build_hierarchy(
+	global const uint* codes,
+	uint sphere_count,
+	global BVHNode* nodes,
+	global uint* internal_slot,
+	global uint* parent,
+	global uint* leaf_slot
+) {
+	int i = get_global_id(0);
+	int n = sphere_count;
+
+	if(n == 1 && i == 0) {
+		nodes[0].left_first = 0;
+		nodes[0].sphere_count = 1;
+		leaf_slot[0] = 0;
+		return;
+	}
+
+	if(i >= n - 1) return;
+
+	if(i == 0) internal_slot[0] = 0;
+
+	// Direction of the range, towards the neighbour with the longer common prefix.
+	int d = (lbvh_delta(codes, n, i, i + 1) - lbvh_delta(codes, n, i, i - 1)) >= 0 ? 1 : -1;
+
+	// Upper bound for the range length, then binary search the other end.
+	int delta_min = lbvh_delta(codes, n, i, i - d);
+	int l_max = 2;
+	while(lbvh_delta(codes, n, i, i + l_max * d) > delta_min) l_max *= 2;
+
+	int l = 0;
+	for(int t = l_max / 2; t >= 1; t /= 2) {
+		if(lbvh_delta(codes, n, i, i + (l + t) * d) > delta_min) l += t;
+	}
+	int j = i + l * d;
+
+	// Binary search the split, the last key sharing more than delta_node bits with i.
+	int delta_node = lbvh_delta(codes, n, i, j);
+	int s = 0, divisor = 2, t;
+	do {
+		t = (l + divisor - 1) / divisor;
+		if(lbvh_delta(codes, n, i, i + (s + t) * d) > delta_node) s += t;
+		divisor *= 2;
+	} while(t > 1);
+
+	int gamma = i + s * d + min(d, 0);
+
+	uint left_slot = 2 * i + 1;
+	uint right_slot = 2 * i + 2;
+
+	// Internal children fill in their own node in lbvh_fit_bounds.
+	if(min(i, j) == gamma) {
+		nodes[left_slot].left_first = gamma;
+		nodes[left_slot].sphere_count = 1;
+		leaf_slot[gamma] = left_slot;
+	} else {
+		internal_slot[gamma] = left_slot;
+	}
+
+	if(max(i, j) == gamma + 1) {
+		nodes[right_slot].left_first = gamma + 1;
+		nodes[right_slot].sphere_count = 1;
+		leaf_slot[gamma + 1] = right_slot;
+	} else {
+		internal_slot[gamma + 1] = right_slot;
+	}
+
+	parent[left_slot] = i;
+	parent[right_slot] = i;
+}
+
+// Karras' bottom-up pass. The first work-item to reach a node stops, the second
+// one knows both children are done and carries on with the parent.
+// visits must be zeroed, one counter per internal node.
+kernel void lbvh_fit_bounds(
+	global const Sphere* spheres,
+	uint sphere_count,
+	global BVHNode* nodes,
+	global const uint* internal_slot,
+	global const uint* parent,
+	global const uint* leaf_slot,
+	global volatile uint* visits
+) {
+	uint k = get_global_id(0);
+	if(k >= sphere_count) return;
+
+	uint slot = leaf_slot[k];
+	nodes[slot].bounds = spheres[k].bbox;
+
+	while(slot != 0) {
+		uint p = parent[slot];
+
+		// Make our child's bounds visible before telling the sibling we're done.
+		mem_fence(CLK_GLOBAL_MEM_FENCE);
+		if(atomic_inc(&visits[p]) == 0) return;
+		mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+		slot = internal_slot[p];
+		uint first_child = 2 * p + 1;
+		nodes[slot].left_first = first_child;
+		nodes[slot].sphere_count = 0;
+		nodes[slot].bounds = aabb_union(nodes[first_child].bounds, nodes[first_child + 1].bounds);
+	}
+}
@@ -0,0 +1,60 @@
+#include "kernels/test_kernel.cl"
+
+// Persistent-threads version of test_kernel.
+// Aila and Laine, "Understanding the Efficiency of Ray Traversal on GPUs", 2009.
+//
+// The host launches only about as many work-groups as the device keeps
+// resident. Each one keeps taking the next batch of get_local_size(0) pixels
+// from `work_counter` until the frame is done, so a group stuck on long paths
+// doesn't hold up the others. `work_counter` must be zeroed before each launch.
+// A pixel is handed out once per launch, and renders all samples_per_launch
+// samples itself. Two work-items on the same pixel would race on its pixel in
+// `input`.
+kernel void persistent_kernel(
+	read_write image2d_t input,
+
+	global Sphere* spheres,
+	int sphere_count,
+
+	global BVHTraversalNode* bvh_nodes,
+	uint bvh_size,
+
+	int max_depth,
+
+	global Lambertian* lambertians,
+	global Metal* metals,
+	global Dielectric* dielectrics,
+
+	global Texture* textures,
+
+	Camera camera,
+	int samples_per_launch,
+
+	global volatile uint* work_counter
+	BVH_STATS_PARAM
+) {
+	const uint width = get_image_width(input);
+	const uint pixel_count = width * get_image_height(input);
+
+	local uint batch_start;
+
+	while(1) {
+		if(get_local_id(0) == 0) {
+			batch_start = atomic_add(work_counter, (uint)get_local_size(0));
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		uint start = batch_start;
+		// Everyone has read it before it gets overwritten.
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		if(start >= pixel_count) return;
+
+		uint pixel = start + get_local_id(0);
+		if(pixel < pixel_count) {
+			int2 pos = {pixel % width, pixel / width};
+			float2 moments;
+			render_pixel(input, pos, samples_per_launch, &moments, spheres, sphere_count, bvh_nodes, bvh_size, max_depth, lambertians, metals, dielectrics, textures, &camera BVH_STATS_ARG);
+		}
+	}
+}
@@ -0,0 +1,28 @@
+uchar resolve_channel(float value, float gamma_scale) {
+	return 256 * clamp(sqrt(gamma_scale * value), 0.0f, 0.999f);
+}
+
+// Turns the accumulation image into 8-bit pixels on the device, so only those
+// get read back. Divides by the sample count, applies gamma 2 and clamps, the
+// same as the host used to.
+// A samples_per_pixel of 0 divides each pixel by its own sample count, kept
+// in alpha. `channels` is 3 for RGB8 or 4 for RGBA8, with an opaque alpha.
+kernel void resolve(
+	read_only image2d_t image,
+	global uchar* pixels,
+	int samples_per_pixel,
+	int channels
+) {
+	int2 pos = (int2)(get_global_id(0), get_global_id(1));
+	if(pos.x >= get_image_width(image) || pos.y >= get_image_height(image)) return;
+
+	float4 color = read_imagef(image, pos);
+	float samples = samples_per_pixel > 0 ? samples_per_pixel : max(color.w, 1.0f);
+	float gamma_scale = 1.0f / samples;
+
+	global uchar* pixel = pixels + (pos.y * get_image_width(image) + pos.x) * channels;
+	pixel[0] = resolve_channel(color.x, gamma_scale);
+	pixel[1] = resolve_channel(color.y, gamma_scale);
+	pixel[2] = resolve_channel(color.z, gamma_scale);
+	if(channels == 4) pixel[3] = 255;
+}
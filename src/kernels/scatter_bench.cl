@@ -0,0 +1,69 @@
+#include "device/hit_record.h"
+#include "device/ray.h"
+#include "device/cl_util.cl"
+
+#include "common/lambertian.h"
+#include "common/metal.h"
+#include "common/camera.h"
+#include "common/texture.h"
+
+// Microbenchmark of the scatter functions, see bench/scatter_bench.cpp.
+// Every work-item scatters `iterations` times off a hit with a normal of its
+// own, and sums the directions so the compiler can't drop the work.
+
+HitRecord bench_hit(uint2* private seed) {
+	HitRecord rec;
+	rec.p = (float3)(0, 0, 0);
+	rec.normal = random_unit_vector(seed);
+	rec.t = 1;
+	rec.uv = (float2)(0, 0);
+	rec.front_face = true;
+	return rec;
+}
+
+kernel void bench_lambertian(global float3* out, int iterations, global Texture* textures) {
+	uint i = get_global_id(0);
+	uint2 seed = rng_init((int2)(i, 0), 0, 0);
+
+	HitRecord rec = bench_hit(&seed);
+	Ray r_in = ray((float3)(0, 0, 1), -rec.normal);
+
+	float3 sum = (float3)(0, 0, 0);
+	for(int k = 0; k < iterations; k++) {
+		Ray scattered;
+		float3 color;
+		rng_set_bounce(&seed, k);
+		if(lambertian_scatter(0, textures, &r_in, &rec, &color, &scattered, &seed)) sum += scattered.d * color;
+	}
+	out[i] = sum;
+}
+
+kernel void bench_metal(global float3* out, int iterations, global Metal* metals) {
+	uint i = get_global_id(0);
+	uint2 seed = rng_init((int2)(i, 0), 0, 0);
+
+	HitRecord rec = bench_hit(&seed);
+	Ray r_in = ray((float3)(0, 0, 1), -rec.normal);
+
+	float3 sum = (float3)(0, 0, 0);
+	for(int k = 0; k < iterations; k++) {
+		Ray scattered;
+		float3 color;
+		rng_set_bounce(&seed, k);
+		if(metal_scatter(metals, &r_in, &rec, &color, &scattered, &seed)) sum += scattered.d * color;
+	}
+	out[i] = sum;
+}
+
+kernel void bench_camera(global float3* out, int iterations, Camera camera) {
+	uint i = get_global_id(0);
+	uint2 seed = rng_init((int2)(i, 0), 0, 0);
+
+	float3 sum = (float3)(0, 0, 0);
+	for(int k = 0; k < iterations; k++) {
+		rng_set_bounce(&seed, k);
+		Ray r = camera_get_ray(&camera, 0.5f, 0.5f, &seed);
+		sum += r.o + r.d;
+	}
+	out[i] = sum;
+}
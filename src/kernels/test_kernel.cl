@@ -1,6 +1,7 @@
 #include "device/hit_record.h"
 #include "device/ray.h"
 #include "device/cl_util.cl"
+#include "device/russian_roulette.h"
 
 #include "common/interval.h"
 #include "common/sphere.h"
@@ -9,16 +10,21 @@
 #include "common/dielectric.h"
 #include "common/camera.h"
 #include "common/bvh_node.h"
+#include "common/bvh_wide_node.h"
 #include "common/texture.h"
 
 #define MAX_DEPTH 64
 
+float luminance(float3 color) {
+	return dot(color, (float3)(0.2126f, 0.7152f, 0.0722f));
+}
+
 float3 ray_color(
 	Ray r,
 	global Sphere* spheres,
 	int sphere_count,
 
-	global BVHNode* bvh_nodes,
+	global BVHTraversalNode* bvh_nodes,
 	int bvh_size,
 
 	int max_depth,
@@ -28,18 +34,20 @@ float3 ray_color(
 	global Dielectric* dielectrics,
 
 	global Texture* textures
+	BVH_STATS_PARAM
 ) {
 	max_depth = min(max_depth, MAX_DEPTH);
 	float3 attenuation = (float3)(1, 1, 1);
 
 	for(int i = 0; i < max_depth - 1; i++) {
+		rng_set_bounce(seed, i + 1);
 
 		HitRecord rec;
 		Interval ray_t = interval(0.001f, infinity);
 #if 0
 		bool hit = closest_hit(spheres, sphere_count, r, &ray_t, &rec);
 #else
-		bool hit = bvh_intersect(bvh_nodes, spheres, &r, &ray_t, &rec);
+		bool hit = bvh_traverse(bvh_nodes, bvh_size, spheres, &r, &ray_t, &rec);
 #endif
 
 		if(hit) {
@@ -69,6 +77,10 @@ float3 ray_color(
 
 			r = scattered;
 			attenuation *= color;
+
+			if(!russian_roulette(i + 1, &attenuation, seed)) {
+				return (float3)(0, 0, 0);
+			}
 		} else {
 			float3 unit_direction = normalize(r.d);
 			float a = 0.5 * (unit_direction.y + 1.0);
@@ -80,16 +92,21 @@ float3 ray_color(
 	return attenuation;
 }
 
-kernel void test_kernel(
+// `samples` samples of the pixel at `pos`, summed in registers and added to
+// `input` once. `moments` gets the sum of the samples' luminance and of its
+// square, for adaptive sampling.
+void render_pixel(
 	read_write image2d_t input,
+	int2 pos,
+	int samples,
+	float2* moments,
 
-	global Sphere* spheres, 
+	global Sphere* spheres,
 	int sphere_count,
 
-	global BVHNode* bvh_nodes,
+	global BVHTraversalNode* bvh_nodes,
 	uint bvh_size,
 
-	global uint2* seeds,
 	int max_depth,
 
 	global Lambertian* lambertians,
@@ -98,32 +115,63 @@ kernel void test_kernel(
 
 	global Texture* textures,
 
-	Camera camera
+	const Camera* camera
+	BVH_STATS_PARAM
 ) {
 	const uint width = get_image_width(input);
 	const uint height = get_image_height(input);
-	
-	float2 pos = {get_global_id(0), get_global_id(1)};
 
-	/* printf("%f %f\n", pos.x, pos.y); */
-	int thread_index = get_global_id(0) + width * get_global_id(1);
-	
-	uint2 seed = seeds[thread_index];
+	// Alpha counts the samples, it numbers the ones taken here.
+	float4 prev_color = read_imagef(input, pos);
+	uint first_sample = prev_color.w;
 
-	float du = (random_float(&seed) - 0.5) * 2;
-	float dv = (random_float(&seed) - 0.5) * 2;
-	
-	float u = (float)(pos.x+du) / (float)(width-1);
-	float v = (float)(pos.y+dv) / (float)(height-1);
-	
-	Ray r = camera_get_ray(&camera, u, v, &seed);
+	float3 pixel_color = (float3)(0, 0, 0);
+	*moments = (float2)(0, 0);
+	for(int i = 0; i < samples; i++) {
+		uint2 seed = rng_init(pos, width, first_sample + i);
+
+		float du = (random_float(&seed) - 0.5) * 2;
+		float dv = (random_float(&seed) - 0.5) * 2;
+
+		float u = (float)(pos.x+du) / (float)(width-1);
+		float v = (float)(pos.y+dv) / (float)(height-1);
 
-	float4 prev_color = read_imagef(input, (int2)(pos.x, pos.y));
-	float3 pixel_color = ray_color(r, spheres, sphere_count, bvh_nodes, bvh_size, max_depth, &seed, lambertians, metals, dielectrics, textures);
+		Ray r = camera_get_ray(camera, u, v, &seed);
+		float3 sample_color = ray_color(r, spheres, sphere_count, bvh_nodes, bvh_size, max_depth, &seed, lambertians, metals, dielectrics, textures BVH_STATS_ARG);
+		pixel_color += sample_color;
 
-	float4 final_color = prev_color + (float4)(pixel_color, 1.0);
+		float l = luminance(sample_color);
+		*moments += (float2)(l, l * l);
+	}
+
+	float4 final_color = prev_color + (float4)(pixel_color, samples);
 	
-	write_imagef(input, (int2)(pos.x,pos.y), final_color);
+	write_imagef(input, pos, final_color);
+}
+
+kernel void test_kernel(
+	read_write image2d_t input,
+
+	global Sphere* spheres, 
+	int sphere_count,
+
+	global BVHTraversalNode* bvh_nodes,
+	uint bvh_size,
+
+	int max_depth,
+
+	global Lambertian* lambertians,
+	global Metal* metals,
+	global Dielectric* dielectrics,
+
+	global Texture* textures,
+
+	Camera camera,
+	int samples_per_launch
+	BVH_STATS_PARAM
+) {
+	int2 pos = {get_global_id(0), get_global_id(1)};
+	float2 moments;
 
-	seeds[thread_index] = seed;
+	render_pixel(input, pos, samples_per_launch, &moments, spheres, sphere_count, bvh_nodes, bvh_size, max_depth, lambertians, metals, dielectrics, textures, &camera BVH_STATS_ARG);
 } 
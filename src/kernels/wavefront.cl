@@ -0,0 +1,341 @@
+#include "device/hit_record.h"
+#include "device/ray.h"
+#include "device/cl_util.cl"
+#include "device/russian_roulette.h"
+
+#include "common/interval.h"
+#include "common/sphere.h"
+#include "common/lambertian.h"
+#include "common/metal.h"
+#include "common/dielectric.h"
+#include "common/camera.h"
+#include "common/bvh_node.h"
+#include "common/bvh_wide_node.h"
+#include "common/texture.h"
+#include "common/path_state.h"
+
+// Wavefront version of test_kernel.cl.
+// Laine et al., "Megakernels Considered Harmful: Wavefront Path Tracing on GPUs", 2013.
+//
+// One sample per pixel is split into small kernels (see host/Wavefront.h):
+// 	1. wf_generate     One path per pixel, all of them go into the ray queue.
+// 	2. wf_extend       Traces the queued rays. Misses finish their path with the
+// 	                   sky, hits get pushed into the queue of their material.
+// 	3. wf_shade_*      Scatters the hits of one material, and pushes the paths
+// 	                   that keep going into the next ray queue.
+// 	4. wf_accumulate   Adds every path's radiance to its pixel.
+// Steps 2 and 3 repeat max_depth - 1 times, with the ray queues swapped.
+//
+// Queue sizes live in `counters`, see path_state.h. The host launches every
+// step over all pixels, the work-items past a queue's size return right away,
+// so nothing has to be read back between steps.
+// Each path draws the same random numbers as in the megakernel, so both render
+// the same image.
+//
+// With -DWF_SORT_HITS the hits aren't pushed straight into their material's
+// queue. wf_extend counts them per sort key (material type, then instance),
+// wf_sort_scan turns the counts into offsets and wf_sort_scatter writes one
+// sorted queue. Every material then shades a contiguous range, with the hits
+// on the same instance next to each other.
+
+#ifdef WF_SORT_HITS
+// key_bases[type] is the first key of a material type, key_bases[WF_MATERIAL_TYPES]
+// the number of keys.
+#define WF_SORT_PARAMS , global uint* hit_queue, global uint* hit_keys, global volatile uint* key_bins, global const uint* key_bases
+#else
+#define WF_SORT_PARAMS
+#endif
+
+// `image` is only read for its sample counts, which number the new samples.
+kernel void wf_generate(
+	global PathState* paths,
+	global uint* ray_queue,
+	read_only image2d_t image,
+	Camera camera
+) {
+	const uint width = get_image_width(image);
+	const uint height = get_image_height(image);
+
+	uint i = get_global_id(0);
+	if(i >= width * height) return;
+
+	int2 pixel = (int2)(i % width, i / width);
+	uint2 seed = rng_init(pixel, width, read_imagef(image, pixel).w);
+	float2 pos = {pixel.x, pixel.y};
+
+	float du = (random_float(&seed) - 0.5) * 2;
+	float dv = (random_float(&seed) - 0.5) * 2;
+
+	float u = (float)(pos.x+du) / (float)(width-1);
+	float v = (float)(pos.y+dv) / (float)(height-1);
+
+	Ray r = camera_get_ray(&camera, u, v, &seed);
+
+	global PathState* path = &paths[i];
+	path->origin = r.o;
+	path->direction = r.d;
+	path->throughput = (float3)(1, 1, 1);
+	path->radiance = (float3)(1, 1, 1);
+	path->seed = seed;
+	path->depth = 0;
+
+	ray_queue[i] = i;
+}
+
+kernel void wf_extend(
+	global PathState* paths,
+	global const uint* ray_queue,
+	global uint* material_queues,
+	global volatile uint* counters,
+	uint path_count,
+
+	global Sphere* spheres,
+	global BVHTraversalNode* bvh_nodes,
+	uint bvh_size
+	WF_SORT_PARAMS
+	BVH_STATS_PARAM
+) {
+	uint q = get_global_id(0);
+	if(q >= counters[WF_RAY_COUNT]) return;
+
+	uint p = ray_queue[q];
+	global PathState* path = &paths[p];
+
+	Ray r = ray(path->origin, path->direction);
+	HitRecord rec;
+	Interval ray_t = interval(0.001f, infinity);
+
+	if(!bvh_traverse(bvh_nodes, bvh_size, spheres, &r, &ray_t, &rec)) {
+		float3 unit_direction = normalize(r.d);
+		float a = 0.5 * (unit_direction.y + 1.0);
+		path->radiance = path->throughput * ((1.0f-a) * (float3)(1, 1, 1) + a * (float3)(0.5, 0.7, 1.0));
+		return;
+	}
+
+	uint type = rec.mat_id.material_type;
+	if(type >= WF_MATERIAL_TYPES) {
+		path->radiance = (float3)(1, 0, 1);
+		return;
+	}
+
+	path->hit_p = rec.p;
+	path->hit_normal = rec.normal;
+	path->hit_uv = rec.uv;
+	path->hit_front_face = rec.front_face;
+	path->hit_mat_id = rec.mat_id;
+
+#ifdef WF_SORT_HITS
+	uint key = key_bases[type] + rec.mat_id.material_instance;
+	uint slot = atomic_inc(&counters[WF_HIT_COUNT]);
+	hit_queue[slot] = p;
+	hit_keys[slot] = key;
+	atomic_inc(&key_bins[key]);
+#else
+	uint slot = atomic_inc(&counters[WF_MATERIAL_COUNT + type]);
+	material_queues[type * path_count + slot] = p;
+#endif
+}
+
+#ifdef WF_SORT_HITS
+// Exclusive scan of key_bins in place, then the queue range of every material
+// type. Runs as a single work-group, there's one key per material instance.
+kernel void wf_sort_scan(
+	global uint* key_bins,
+	global const uint* key_bases,
+	global uint* counters,
+	local uint* partial_sums
+) {
+	uint lid = get_local_id(0);
+	uint group_size = get_local_size(0);
+	uint key_count = key_bases[WF_MATERIAL_TYPES];
+
+	uint per_item = (key_count + group_size - 1) / group_size;
+	uint first = min(key_count, lid * per_item);
+	uint end = min(key_count, first + per_item);
+
+	uint sum = 0;
+	for(uint i = first; i < end; i++) sum += key_bins[i];
+	partial_sums[lid] = sum;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint offset = 0;
+	for(uint i = 0; i < lid; i++) offset += partial_sums[i];
+
+	for(uint i = first; i < end; i++) {
+		uint value = key_bins[i];
+		key_bins[i] = offset;
+		offset += value;
+	}
+
+	barrier(CLK_GLOBAL_MEM_FENCE);
+
+	if(lid == 0) {
+		uint hit_count = counters[WF_HIT_COUNT];
+		for(uint type = 0; type < WF_MATERIAL_TYPES; type++) {
+			uint start = key_bases[type] < key_count ? key_bins[key_bases[type]] : hit_count;
+			uint next = key_bases[type + 1] < key_count ? key_bins[key_bases[type + 1]] : hit_count;
+			counters[WF_MATERIAL_START + type] = start;
+			counters[WF_MATERIAL_COUNT + type] = next - start;
+		}
+	}
+}
+
+kernel void wf_sort_scatter(
+	global const uint* hit_queue,
+	global const uint* hit_keys,
+	global volatile uint* key_bins,
+	global uint* material_queues,
+	global const uint* counters
+) {
+	uint i = get_global_id(0);
+	if(i >= counters[WF_HIT_COUNT]) return;
+
+	material_queues[atomic_inc(&key_bins[hit_keys[i]])] = hit_queue[i];
+}
+#endif
+
+// Index of the path this work-item shades, or UINT_MAX if the queue is shorter.
+uint wf_shade_path(global const uint* material_queues, global volatile uint* counters, uint path_count, uint type) {
+	uint q = get_global_id(0);
+	if(q >= counters[WF_MATERIAL_COUNT + type]) return UINT_MAX;
+#ifdef WF_SORT_HITS
+	return material_queues[counters[WF_MATERIAL_START + type] + q];
+#else
+	return material_queues[type * path_count + q];
+#endif
+}
+
+HitRecord wf_load_hit(global const PathState* path) {
+	HitRecord rec;
+	rec.p = path->hit_p;
+	rec.normal = path->hit_normal;
+	rec.uv = path->hit_uv;
+	rec.front_face = path->hit_front_face;
+	rec.mat_id = path->hit_mat_id;
+	return rec;
+}
+
+// Same as the end of a bounce in the megakernel's ray_color.
+void wf_continue(
+	global PathState* path,
+	uint p,
+	bool scatter,
+	float3 color,
+	Ray scattered,
+	uint2 seed,
+	global uint* next_ray_queue,
+	global volatile uint* counters,
+	int max_depth
+) {
+	if(!scatter) {
+		path->seed = seed;
+		path->radiance = (float3)(1, 0, 1);
+		return;
+	}
+
+	float3 throughput = path->throughput * color;
+	uint depth = path->depth + 1;
+	bool survived = russian_roulette(depth, &throughput, &seed);
+
+	path->seed = seed;
+	path->origin = scattered.o;
+	path->direction = scattered.d;
+	path->throughput = throughput;
+	path->radiance = survived ? throughput : (float3)(0, 0, 0);
+	path->depth = depth;
+
+	if(survived && depth < min(max_depth, WF_MAX_DEPTH) - 1) {
+		next_ray_queue[atomic_inc(&counters[WF_NEXT_RAY_COUNT])] = p;
+	}
+}
+
+kernel void wf_shade_lambertian(
+	global PathState* paths,
+	global const uint* material_queues,
+	global uint* next_ray_queue,
+	global volatile uint* counters,
+	uint path_count,
+	int max_depth,
+	global Texture* textures
+) {
+	uint p = wf_shade_path(material_queues, counters, path_count, MATERIAL_LAMBERTIAN);
+	if(p == UINT_MAX) return;
+
+	global PathState* path = &paths[p];
+	Ray r = ray(path->origin, path->direction);
+	HitRecord rec = wf_load_hit(path);
+	uint2 seed = path->seed;
+	rng_set_bounce(&seed, path->depth + 1);
+
+	Ray scattered;
+	float3 color = (float3)(0, 0, 0);
+	bool scatter = lambertian_scatter(rec.mat_id.texture_index, textures, &r, &rec, &color, &scattered, &seed);
+
+	wf_continue(path, p, scatter, color, scattered, seed, next_ray_queue, counters, max_depth);
+}
+
+kernel void wf_shade_metal(
+	global PathState* paths,
+	global const uint* material_queues,
+	global uint* next_ray_queue,
+	global volatile uint* counters,
+	uint path_count,
+	int max_depth,
+	global Metal* metals
+) {
+	uint p = wf_shade_path(material_queues, counters, path_count, MATERIAL_METAL);
+	if(p == UINT_MAX) return;
+
+	global PathState* path = &paths[p];
+	Ray r = ray(path->origin, path->direction);
+	HitRecord rec = wf_load_hit(path);
+	uint2 seed = path->seed;
+	rng_set_bounce(&seed, path->depth + 1);
+
+	Ray scattered;
+	float3 color = (float3)(0, 0, 0);
+	bool scatter = metal_scatter(&metals[rec.mat_id.material_instance], &r, &rec, &color, &scattered, &seed);
+
+	wf_continue(path, p, scatter, color, scattered, seed, next_ray_queue, counters, max_depth);
+}
+
+kernel void wf_shade_dielectric(
+	global PathState* paths,
+	global const uint* material_queues,
+	global uint* next_ray_queue,
+	global volatile uint* counters,
+	uint path_count,
+	int max_depth,
+	global Dielectric* dielectrics
+) {
+	uint p = wf_shade_path(material_queues, counters, path_count, MATERIAL_DIELECTRIC);
+	if(p == UINT_MAX) return;
+
+	global PathState* path = &paths[p];
+	Ray r = ray(path->origin, path->direction);
+	HitRecord rec = wf_load_hit(path);
+	uint2 seed = path->seed;
+	rng_set_bounce(&seed, path->depth + 1);
+
+	Ray scattered;
+	float3 color = (float3)(0, 0, 0);
+	bool scatter = dielectric_scatter(dielectrics[rec.mat_id.material_instance], &r, &rec, &color, &scattered, &seed);
+
+	wf_continue(path, p, scatter, color, scattered, seed, next_ray_queue, counters, max_depth);
+}
+
+kernel void wf_accumulate(
+	read_write image2d_t output,
+	global const PathState* paths
+) {
+	const uint width = get_image_width(output);
+	const uint height = get_image_height(output);
+
+	uint i = get_global_id(0);
+	if(i >= width * height) return;
+
+	int2 pos = (int2)(i % width, i / width);
+	float4 prev_color = read_imagef(output, pos);
+	write_imagef(output, pos, prev_color + (float4)(paths[i].radiance, 1.0));
+}
@@ -1,8 +1,26 @@
+#include "host/AdaptiveSampler.h"
+#include "host/BVH.h"
+#include "host/BVHStats.h"
 #include "host/CLBuffer.h"
+#include "host/CLKernel.h"
 #include "host/CLUtil.h"
+#include "host/Checkpoint.h"
+#include "host/ImageResolve.h"
+#include "host/ImageWriter.h"
+#include "host/LBVH.h"
+#include "host/PPM.h"
+#include "host/ProgramCache.h"
+#include "host/RenderOptions.h"
+#include "host/SceneCache.h"
+#include "host/SkipLinkBVH.h"
+#include "host/Wavefront.h"
+#include "host/WideBVH.h"
 
 #include "host/builtin_scenes.h"
+#include "host/RenderServer.h"
 #include <CL/cl.h>
+#include <condition_variable>
+#include <mutex>
 #include <optional>
 #include <sched.h>
 
@@ -10,6 +28,7 @@ using std::vector, std::string;
 using std::chrono::high_resolution_clock;
 using std::chrono::duration_cast;
 using std::chrono::milliseconds;
+using std::chrono::microseconds;
 
 
 void parseInt(int& var, const std::string& name, const char* intStr) {
@@ -26,9 +45,24 @@ void parseInt(int& var, const std::string& name, const char* intStr) {
   if(var < 0) { BAD_ARG(); }
 }
 
+void parseFloat(float& var, const std::string& name, const char* floatStr) {
+  try {
+    var = std::stof(floatStr);
+  } catch(std::invalid_argument const& e) {
+    std::cerr << fmt("Invalid value for the argument \"%s\" (%s). Aborting\n", name.c_str(), floatStr);
+    std::exit(EXIT_FAILURE);
+  }
+
+  if(var < 0) {
+    std::cerr << fmt("Invalid value for the argument \"%s\" (%s). Aborting\n", name.c_str(), floatStr);
+    std::exit(EXIT_FAILURE);
+  }
+}
+
 void parseArguments(const char **argv, int argc, int &samplesPerPixel,
                     int &maxDepth, int &imageWidth, int &imageHeight,
-                    std::string &outputFileName) {
+                    std::string &outputFileName, BVHBuildOptions &bvhOptions,
+                    RenderOptions &renderOptions) {
 
   for(int i = 1; i < argc; i++) {
     if(STR_EQ(argv[i], "--samples")) {
@@ -46,6 +80,197 @@ void parseArguments(const char **argv, int argc, int &samplesPerPixel,
     } else if(STR_EQ(argv[i], "-o") || STR_EQ(argv[i], "--output")) {
       outputFileName = std::string(argv[i+1]);
       i += 1;
+    } else if(STR_EQ(argv[i], "--format")) {
+      renderOptions.outputFormat = i + 1 < argc ? imageFormatFromName(argv[i+1]) : std::nullopt;
+      if(!renderOptions.outputFormat) {
+        std::cerr << fmt("Invalid value for the argument \"format\" (%s). Aborting\n", i + 1 < argc ? argv[i+1] : "");
+        std::exit(EXIT_FAILURE);
+      }
+      i += 1;
+    } else if(STR_EQ(argv[i], "--integrator")) {
+      if(i + 1 < argc && STR_EQ(argv[i+1], "megakernel")) {
+        renderOptions.integrator = Integrator::Megakernel;
+      } else if(i + 1 < argc && STR_EQ(argv[i+1], "wavefront")) {
+        renderOptions.integrator = Integrator::Wavefront;
+      } else if(i + 1 < argc && STR_EQ(argv[i+1], "persistent")) {
+        renderOptions.integrator = Integrator::Persistent;
+      } else {
+        std::cerr << fmt("Invalid value for the argument \"integrator\" (%s). Aborting\n", i + 1 < argc ? argv[i+1] : "");
+        std::exit(EXIT_FAILURE);
+      }
+      i += 1;
+    } else if(STR_EQ(argv[i], "--sampler")) {
+      if(i + 1 < argc && STR_EQ(argv[i+1], "random")) {
+        renderOptions.sampler = Sampler::Random;
+      } else if(i + 1 < argc && STR_EQ(argv[i+1], "sobol")) {
+        renderOptions.sampler = Sampler::Sobol;
+      } else if(i + 1 < argc && STR_EQ(argv[i+1], "bluenoise")) {
+        renderOptions.sampler = Sampler::BlueNoise;
+      } else {
+        std::cerr << fmt("Invalid value for the argument \"sampler\" (%s). Aborting\n", i + 1 < argc ? argv[i+1] : "");
+        std::exit(EXIT_FAILURE);
+      }
+      i += 1;
+    } else if(STR_EQ(argv[i], "--rejection-sampling")) {
+      renderOptions.rejectionSampling = true;
+    } else if(STR_EQ(argv[i], "--russian-roulette")) {
+      parseInt(renderOptions.russianRouletteDepth, "russian-roulette", argv[i+1]);
+      if(renderOptions.russianRouletteDepth < 1) {
+        std::cerr << "--russian-roulette needs a minimum depth of at least 1. Aborting\n";
+        std::exit(EXIT_FAILURE);
+      }
+      i += 1;
+    } else if(STR_EQ(argv[i], "--sort-hits")) {
+      renderOptions.sortHits = true;
+    } else if(STR_EQ(argv[i], "--samples-per-launch")) {
+      parseInt(renderOptions.samplesPerLaunch, "samples-per-launch", argv[i+1]);
+      if(renderOptions.samplesPerLaunch < 1) {
+        std::cerr << "--samples-per-launch needs at least 1 sample. Aborting\n";
+        std::exit(EXIT_FAILURE);
+      }
+      i += 1;
+    } else if(STR_EQ(argv[i], "--noise-threshold")) {
+      parseFloat(renderOptions.noiseThreshold, "noise-threshold", argv[i+1]);
+      i += 1;
+    } else if(STR_EQ(argv[i], "--adaptive-min-samples")) {
+      parseInt(renderOptions.adaptiveMinSamples, "adaptive-min-samples", argv[i+1]);
+      i += 1;
+    } else if(STR_EQ(argv[i], "--checkpoint-every")) {
+      if(i + 1 >= argc) {
+        std::cerr << "--checkpoint-every needs a number of milliseconds (e.g. 60000ms) or samples. Aborting\n";
+        std::exit(EXIT_FAILURE);
+      }
+      std::string every = argv[i+1];
+      renderOptions.checkpointInSamples = every.size() < 2 || every.compare(every.size() - 2, 2, "ms") != 0;
+      if(!renderOptions.checkpointInSamples) every.resize(every.size() - 2);
+      parseInt(renderOptions.checkpointEvery, "checkpoint-every", every.c_str());
+      if(renderOptions.checkpointEvery < 1) {
+        std::cerr << "--checkpoint-every needs an interval of at least 1. Aborting\n";
+        std::exit(EXIT_FAILURE);
+      }
+      i += 1;
+    } else if(STR_EQ(argv[i], "--resume")) {
+      if(i + 1 >= argc) {
+        std::cerr << "--resume needs a checkpoint file. Aborting\n";
+        std::exit(EXIT_FAILURE);
+      }
+      renderOptions.resumePath = argv[i+1];
+      i += 1;
+    } else if(STR_EQ(argv[i], "--sample-range")) {
+      std::string range = i + 1 < argc ? argv[i+1] : "";
+      size_t colon = range.find(':');
+      if(colon == std::string::npos) {
+        std::cerr << fmt("Invalid value for the argument \"sample-range\" (%s), expected start:count. Aborting\n", range.c_str());
+        std::exit(EXIT_FAILURE);
+      }
+      parseInt(renderOptions.sampleRangeStart, "sample-range", range.substr(0, colon).c_str());
+      parseInt(renderOptions.sampleRangeCount, "sample-range", range.substr(colon + 1).c_str());
+      if(renderOptions.sampleRangeCount < 1) {
+        std::cerr << "--sample-range needs at least 1 sample. Aborting\n";
+        std::exit(EXIT_FAILURE);
+      }
+      i += 1;
+    } else if(STR_EQ(argv[i], "--program-cache")) {
+      if(i + 1 >= argc) {
+        std::cerr << "--program-cache needs a directory. Aborting\n";
+        std::exit(EXIT_FAILURE);
+      }
+      renderOptions.programCacheDirectory = argv[i+1];
+      i += 1;
+    } else if(STR_EQ(argv[i], "--no-program-cache")) {
+      renderOptions.programCacheDirectory.clear();
+    } else if(STR_EQ(argv[i], "--serve")) {
+      renderOptions.serve = true;
+    } else if(STR_EQ(argv[i], "--serve-socket")) {
+      if(i + 1 >= argc) {
+        std::cerr << "--serve-socket needs a socket path. Aborting\n";
+        std::exit(EXIT_FAILURE);
+      }
+      renderOptions.serve = true;
+      renderOptions.serveSocketPath = argv[i+1];
+      i += 1;
+    } else if(STR_EQ(argv[i], "--sample-heatmap")) {
+      if(i + 1 >= argc) {
+        std::cerr << "--sample-heatmap needs a file name. Aborting\n";
+        std::exit(EXIT_FAILURE);
+      }
+      renderOptions.sampleHeatmapPath = argv[i+1];
+      i += 1;
+    } else if(STR_EQ(argv[i], "--persistent-groups")) {
+      parseInt(renderOptions.persistentGroups, "persistent-groups", argv[i+1]);
+      i += 1;
+    } else if(STR_EQ(argv[i], "--bvh-builder")) {
+      if(i + 1 < argc && STR_EQ(argv[i+1], "sah")) {
+        bvhOptions.builder = BVHBuilder::SAH;
+      } else if(i + 1 < argc && STR_EQ(argv[i+1], "lbvh")) {
+        bvhOptions.builder = BVHBuilder::LBVH;
+      } else {
+        std::cerr << fmt("Invalid value for the argument \"bvh-builder\" (%s). Aborting\n", i + 1 < argc ? argv[i+1] : "");
+        std::exit(EXIT_FAILURE);
+      }
+      i += 1;
+    } else if(STR_EQ(argv[i], "--bvh-bins")) {
+      parseInt(bvhOptions.binCount, "bvh-bins", argv[i+1]);
+      if(bvhOptions.binCount < 2) { 
+        std::cerr << "--bvh-bins needs at least 2 bins. Aborting\n";
+        std::exit(EXIT_FAILURE);
+      }
+      i += 1;
+    } else if(STR_EQ(argv[i], "--bvh-sweep")) {
+      bvhOptions.strategy = BVHSplitStrategy::SweepSAH;
+    } else if(STR_EQ(argv[i], "--bvh-width")) {
+      parseInt(bvhOptions.width, "bvh-width", argv[i+1]);
+      if(bvhOptions.width != 2 && bvhOptions.width != 4 && bvhOptions.width != 8) {
+        std::cerr << "--bvh-width must be 2, 4 or 8. Aborting\n";
+        std::exit(EXIT_FAILURE);
+      }
+      i += 1;
+    } else if(STR_EQ(argv[i], "--bvh-traversal")) {
+      if(i + 1 < argc && STR_EQ(argv[i+1], "stack")) {
+        bvhOptions.traversal = BVHTraversal::Stack;
+      } else if(i + 1 < argc && STR_EQ(argv[i+1], "skip")) {
+        bvhOptions.traversal = BVHTraversal::SkipLinks;
+      } else {
+        std::cerr << fmt("Invalid value for the argument \"bvh-traversal\" (%s). Aborting\n", i + 1 < argc ? argv[i+1] : "");
+        std::exit(EXIT_FAILURE);
+      }
+      i += 1;
+    } else if(STR_EQ(argv[i], "--bvh-layout")) {
+      if(i + 1 < argc && STR_EQ(argv[i+1], "build")) {
+        bvhOptions.layout = BVHLayout::Build;
+      } else if(i + 1 < argc && STR_EQ(argv[i+1], "dfs")) {
+        bvhOptions.layout = BVHLayout::DepthFirst;
+      } else if(i + 1 < argc && STR_EQ(argv[i+1], "treelet")) {
+        bvhOptions.layout = BVHLayout::Treelet;
+      } else {
+        std::cerr << fmt("Invalid value for the argument \"bvh-layout\" (%s). Aborting\n", i + 1 < argc ? argv[i+1] : "");
+        std::exit(EXIT_FAILURE);
+      }
+      i += 1;
+    } else if(STR_EQ(argv[i], "--bvh-cache")) {
+      if(i + 1 >= argc) {
+        std::cerr << "--bvh-cache needs a directory. Aborting\n";
+        std::exit(EXIT_FAILURE);
+      }
+      bvhOptions.cacheDirectory = argv[i+1];
+      i += 1;
+    } else if(STR_EQ(argv[i], "--bvh-stats")) {
+      bvhOptions.stats = true;
+    } else if(STR_EQ(argv[i], "--bvh-stats-json")) {
+      if(i + 1 >= argc) {
+        std::cerr << "--bvh-stats-json needs a file name. Aborting\n";
+        std::exit(EXIT_FAILURE);
+      }
+      bvhOptions.stats = true;
+      bvhOptions.statsJsonPath = argv[i+1];
+      i += 1;
+    } else if(STR_EQ(argv[i], "--bvh-compress")) {
+      bvhOptions.compressed = true;
+    } else if(STR_EQ(argv[i], "--bvh-threads")) {
+      int threads;
+      parseInt(threads, "bvh-threads", argv[i+1]);
+      bvhOptions.threadCount = threads;
+      i += 1;
     } else if (STR_EQ(argv[i], "--scene")) {
       // --scene is checked before this function in order to figure out which
       // scene to initially load. If the scene is checked here, the loading of
@@ -62,7 +287,44 @@ void parseArguments(const char **argv, int argc, int &samplesPerPixel,
       }
 
       std::cerr << "Usage:\n"
-                << fmt("\t%s [--samples number] [--max-depth number] [--image-width number] [--image-height number] [{--output , -o} filename (default: output.ppm)] [--scene number]\n", argv[0]);
+                << fmt("\t%s [--samples number] [--max-depth number] [--image-width number] [--image-height number] [{--output , -o} filename (default: output.ppm)] [--scene number]\n", argv[0])
+                << "\t--format {ppm,p3,pfm,png,exr} (default: from the output file extension, else ppm). pfm and exr keep\n"
+                << "\t\tthe linear float radiance, p3 is ASCII PPM.\n"
+                << "\t--integrator {megakernel,wavefront,persistent} (default: megakernel). wavefront runs one kernel per bounce stage,\n"
+                << "\t\tpersistent keeps a fixed set of work-groups pulling pixels from a queue.\n"
+                << "\t--sampler {random,sobol,bluenoise} (default: random). sobol converges faster, bluenoise also spreads\n"
+                << "\t\tthe remaining noise evenly over the image. All of them take at most 2^20 samples per pixel.\n"
+                << "\t--rejection-sampling: Sample directions and the lens with the old rejection loops, for comparison.\n"
+                << "\t--samples-per-launch number (default: 1). Samples each pixel takes per kernel launch.\n"
+                << "\t--russian-roulette depth: Randomly stop dim paths after this many bounces (unbiased).\n"
+                << "\t--sort-hits: Sort the hits by material before shading, wavefront only.\n"
+                << "\t--persistent-groups number (default: 0, as many as the device keeps resident)\n"
+                << "\t--noise-threshold number (default: 0, off). Stop sampling pixels whose noise drops below it, megakernel only.\n"
+                << "\t--adaptive-min-samples number (default: 16). Samples every pixel takes before it can stop.\n"
+                << "\t--sample-heatmap filename: Write the samples each pixel took as an image.\n"
+                << "\t--checkpoint-every {number,numberms}: Save the render every so many samples, or milliseconds, to the\n"
+                << "\t\toutput file name with .ckpt appended.\n"
+                << "\t--resume filename: Go on from a checkpoint of the same scene and options.\n"
+                << "\t--sample-range start:count: Render only these of the --samples samples of every pixel, and leave\n"
+                << "\t\tthe accumulation in the output file name with .ckpt appended, for sample_merge.\n"
+                << "\t--program-cache directory (default: .program_cache): Keep the built kernels there for the next run.\n"
+                << "\t--no-program-cache: Always build the kernels from source.\n"
+                << "\t--serve: Render jobs read from stdin, one per line, with the kernels built once. Answers go to\n"
+                << "\t\tstdout, see host/RenderServer.h for the keys. Jobs take at most 2^20 samples per pixel,\n"
+                << "\t\tand at most --samples with bluenoise.\n"
+                << "\t--serve-socket path: Same as --serve, for the clients of a Unix socket at path.\n"
+                << "\nBVH options:\n"
+                << "\t--bvh-builder {sah,lbvh} (default: sah). lbvh builds on the device.\n"
+                << "\t--bvh-bins number (default: 16)\n"
+                << "\t--bvh-sweep: Evaluate every sphere center as a split (slow, for reference).\n"
+                << "\t--bvh-threads number (default: 0, all cores)\n"
+                << "\t--bvh-width {2,4,8} (default: 2). Collapses the tree into 4/8-wide nodes.\n"
+                << "\t--bvh-compress: Quantize the child bounds of 4/8-wide nodes to 8 bits.\n"
+                << "\t--bvh-traversal {stack,skip} (default: stack). skip needs no stack, only for width 2.\n"
+                << "\t--bvh-layout {build,dfs,treelet} (default: build). Node order in memory, sah builder only.\n"
+                << "\t--bvh-cache directory: Reuse trees built for the same scene and options, sah builder only.\n"
+                << "\t--bvh-stats: Print tree quality and traversal counters.\n"
+                << "\t--bvh-stats-json filename: Same as --bvh-stats, and also write them as JSON.\n";
 
       std::cerr << "\nAvaialble scenes:\n"
                 << "\t 0: Random spheres\n"
@@ -71,21 +333,98 @@ void parseArguments(const char **argv, int argc, int &samplesPerPixel,
       std::exit(ret);
     }
   }
-}
 
-CLBuffer<uint2> generateSeeds(cl_context& context, cl_command_queue& queue, int imageWidth, int imageHeight) {
-  CLBuffer<uint2> seeds(context, queue, CL_MEM_READ_WRITE, imageWidth * imageHeight);
+  if(renderOptions.sortHits && renderOptions.integrator != Integrator::Wavefront) {
+    std::cerr << "--sort-hits needs --integrator wavefront. Aborting\n";
+    std::exit(EXIT_FAILURE);
+  }
+
+  // Bounds the end of --sample-range as well, it can't go past --samples. A
+  // checkpoint to --resume from is held to the same end when it's loaded.
+  if(samplesPerPixel > maxSamplesPerPixel) {
+    std::cerr << fmt("--samples takes at most %d samples per pixel. Aborting\n", maxSamplesPerPixel);
+    std::exit(EXIT_FAILURE);
+  }
 
-  std::uniform_int_distribution<uint> distribution(0, UINT32_MAX);
-  std::mt19937 generator{42};
+  if(renderOptions.noiseThreshold > 0 && renderOptions.integrator != Integrator::Megakernel) {
+    std::cerr << "--noise-threshold needs --integrator megakernel. Aborting\n";
+    std::exit(EXIT_FAILURE);
+  }
 
-  for (int i = 0; i < imageWidth * imageHeight; i++) {
-    uint a = distribution(generator);
-    uint b = distribution(generator);
-    seeds.push_back(u2(a, b));
+  // The moments and active pixels of adaptive sampling aren't saved.
+  if(renderOptions.noiseThreshold > 0 && (renderOptions.checkpointEvery > 0 || !renderOptions.resumePath.empty()
+                                          || renderOptions.sampleRangeCount > 0)) {
+    std::cerr << "--checkpoint-every, --resume and --sample-range don't work with --noise-threshold. Aborting\n";
+    std::exit(EXIT_FAILURE);
   }
 
-  return seeds;
+  // Jobs bring their own scene, camera and output, what's left to serve is the megakernel.
+  if(renderOptions.serve && (renderOptions.integrator != Integrator::Megakernel || renderOptions.noiseThreshold > 0
+                             || renderOptions.checkpointEvery > 0 || !renderOptions.resumePath.empty()
+                             || renderOptions.sampleRangeCount > 0 || !renderOptions.sampleHeatmapPath.empty()
+                             || bvhOptions.stats || !bvhOptions.cacheDirectory.empty())) {
+    std::cerr << "--serve only works with the megakernel and without --noise-threshold, --checkpoint-every, --resume,\n"
+                 "--sample-range, --sample-heatmap, --bvh-stats and --bvh-cache. Aborting\n";
+    std::exit(EXIT_FAILURE);
+  }
+
+  if(renderOptions.sampleRangeStart + renderOptions.sampleRangeCount > samplesPerPixel) {
+    std::cerr << fmt("--sample-range goes past the %d samples per pixel. Aborting\n", samplesPerPixel);
+    std::exit(EXIT_FAILURE);
+  }
+
+  if(bvhOptions.compressed && bvhOptions.width == 2) {
+    std::cerr << "--bvh-compress needs --bvh-width 4 or 8. Aborting\n";
+    std::exit(EXIT_FAILURE);
+  }
+
+  if(bvhOptions.traversal == BVHTraversal::SkipLinks && bvhOptions.width != 2) {
+    std::cerr << "--bvh-traversal skip needs --bvh-width 2. Aborting\n";
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+// Samples finished so far, counted by `onLaunchComplete`.
+struct SampleProgress {
+  std::mutex mutex;
+  std::condition_variable changed;
+  int done = 0;
+  cl_int status = CL_SUCCESS;
+};
+
+struct Launch {
+  SampleProgress* progress;
+  int samples;
+  cl_event event;
+};
+
+// Runs on a driver thread.
+void CL_CALLBACK onLaunchComplete(cl_event, cl_int status, void* data) {
+  Launch* launch = static_cast<Launch*>(data);
+  {
+    std::lock_guard lock(launch->progress->mutex);
+    launch->progress->done += launch->samples;
+    if(status < 0) launch->progress->status = status;
+  }
+  launch->progress->changed.notify_one();
+}
+
+// OpenCL has no occupancy query. Assume every compute unit keeps as many
+// groups resident as fit in its largest work-group.
+size_t persistentGroupCount(cl_device_id device, size_t localSize) {
+  cl_uint computeUnits;
+  size_t maxGroupSize;
+  clErr(clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(computeUnits), &computeUnits, nullptr));
+  clErr(clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(maxGroupSize), &maxGroupSize, nullptr));
+  return computeUnits * std::max<size_t>(1, maxGroupSize / localSize);
+}
+
+// Moves `nodes` into a buffer and uploads it.
+template<typename Node>
+CLBuffer<Node> uploadNodes(cl_context& context, cl_command_queue& queue, std::vector<Node> nodes) {
+  CLBuffer<Node> buffer = CLBuffer<Node>::fromVector(context, queue, nodes);
+  buffer.uploadToDevice(context);
+  return buffer;
 }
 
 std::optional<int> parseSceneArguement(const char** argv, int argc) {
@@ -111,35 +450,137 @@ int main(int argc, const char** argv) {
   int maxDepth = 10;
   int scene = 0;
   std::string outputFileName = "output.ppm";
+  BVHBuildOptions bvhOptions;
+  RenderOptions renderOptions;
 
   if(auto s = parseSceneArguement(argv, argc); s.has_value()) {
     scene = s.value();
   }
 
-  switch(scene) {
-    case 1: 
-      two_checkered_spheres(cam, imageWidth, imageHeight, samplesPerPixel, maxDepth); break;
-    case 0:
-    default:
-      random_spheres(cam, imageWidth, imageHeight, samplesPerPixel, maxDepth);        break;
-  }
+  load_builtin_scene(scene, cam, imageWidth, imageHeight, samplesPerPixel, maxDepth);
 
-  parseArguments(argv, argc, samplesPerPixel, maxDepth, imageWidth, imageHeight, outputFileName);
+  parseArguments(argv, argc, samplesPerPixel, maxDepth, imageWidth, imageHeight, outputFileName, bvhOptions, renderOptions);
+
+  ProgramCache::setDirectory(renderOptions.programCacheDirectory);
 
   auto [context, queue, device] = setupCL();
-  cl_kernel kernel = kernelFromFile("src/kernels/test_kernel.cl", context, device, {"./src"});
-  
-  auto seeds = generateSeeds(context, queue, imageWidth, imageHeight);
-  seeds.uploadToDevice(context);
+  std::vector<std::string> kernelDefines = { fmt("BVH_WIDTH=%d", bvhOptions.width) };
+  if(bvhOptions.compressed) kernelDefines.push_back("BVH_COMPRESSED");
+  if(bvhOptions.traversal == BVHTraversal::SkipLinks) kernelDefines.push_back("BVH_SKIP_LINKS");
+  if(bvhOptions.stats) kernelDefines.push_back("BVH_STATS");
+  if(renderOptions.sampler == Sampler::Sobol) kernelDefines.push_back("SAMPLER_SOBOL");
+  if(renderOptions.sampler == Sampler::BlueNoise) {
+    int sampleBits = 0;
+    while((1 << sampleBits) < samplesPerPixel) sampleBits++;
+    kernelDefines.push_back("SAMPLER_BLUE_NOISE");
+    kernelDefines.push_back(fmt("SAMPLER_SAMPLE_BITS=%d", sampleBits));
+  }
+  if(renderOptions.rejectionSampling) kernelDefines.push_back("REJECTION_SAMPLING");
+  if(renderOptions.russianRouletteDepth > 0) kernelDefines.push_back(fmt("RUSSIAN_ROULETTE_MIN_DEPTH=%d", renderOptions.russianRouletteDepth));
+
+  if(renderOptions.serve) {
+    // Logs go to stderr, stdout only carries the answers.
+    std::streambuf* coutBuffer = std::cout.rdbuf(std::cerr.rdbuf());
+    bool served = true;
+    {
+      RenderServer server(context, queue, device, kernelDefines, bvhOptions, renderOptions.samplesPerLaunch,
+                          renderOptions.sampler == Sampler::BlueNoise ? samplesPerPixel : maxSamplesPerPixel);
+      if(renderOptions.serveSocketPath.empty()) server.serve(stdin, stdout);
+      else                                      served = server.serveSocket(renderOptions.serveSocketPath);
+    }
+    std::cout.rdbuf(coutBuffer);
+    return served ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
 
-  // SAH doesn't really help with spheres.
-  BVH bvh = BVH(Sphere::instances);
+  // Before the BVH builder reorders the spheres.
+  uint64_t checkpointKey = Checkpoint::sceneKey(cam, imageWidth, imageHeight, maxDepth, kernelDefines);
+
+  cl_kernel kernel = nullptr;
+  std::unique_ptr<Wavefront> wavefront;
+  if(renderOptions.integrator == Integrator::Wavefront) {
+    wavefront = std::make_unique<Wavefront>(context, queue, device, kernelDefines, imageWidth, imageHeight, maxDepth,
+                                            renderOptions.sortHits);
+  } else if(renderOptions.integrator == Integrator::Persistent) {
+    kernel = kernelFromFile("src/kernels/persistent_kernel.cl", context, device, {"./src"}, kernelDefines);
+  } else if(renderOptions.noiseThreshold == 0) {
+    kernel = kernelFromFile("src/kernels/test_kernel.cl", context, device, {"./src"}, kernelDefines);
+  }
+
+  CLBuffer<BVHNode> bvh_nodes(context, queue);
+  CLBuffer<Sphere> spheres(context, queue);
+  // On a hit, the nodes stay mapped for deriving the other layouts.
+  std::unique_ptr<SceneCache::Entry> cached;
+  if(bvhOptions.builder == BVHBuilder::SAH) {
+    std::unique_ptr<SceneCache> cache;
+    if(!bvhOptions.cacheDirectory.empty()) {
+      auto start = high_resolution_clock::now();
+      cache = std::make_unique<SceneCache>(bvhOptions.cacheDirectory, bvhOptions);
+      cached = cache->load();
+
+      // Straight from the mapping to the device, that's where the file is read.
+      if(cached) {
+        bvh_nodes = CLBuffer<BVHNode>::fromDevicePtr(context, queue, cached->nodes(), cached->nodeCount());
+        spheres = CLBuffer<Sphere>::fromDevicePtr(context, queue, cached->spheres(), cached->sphereCount());
+
+        auto loadTime = duration_cast<microseconds>(high_resolution_clock::now() - start).count() / 1000.0;
+        std::cout << fmt("BVH with %u Nodes loaded from %s and uploaded in %.2f ms.\n", cached->nodeCount(),
+                         cache->file().c_str(), loadTime);
+      }
+    }
+
+    if(!cached) {
+      BVH bvh = BVH(Sphere::instances, bvhOptions);
+      bvh_nodes = CLBuffer<BVHNode>::fromPtr(context, queue, bvh.getPool(), bvh.getNodesUsed());
+      if(cache) cache->store(bvh.getPool(), bvh.getNodesUsed(), Sphere::instances);
+      bvh_nodes.uploadToDevice(context);
+    }
+  }
 
   auto image  = PPMImage::black(queue, context, imageWidth, imageHeight);
+
+  // This run takes samples [rangeStart, endSample) of every pixel. Alpha
+  // numbers the samples for the random numbers, so it starts at rangeStart
+  // even though the image sums none of them yet.
+  int rangeStart = renderOptions.sampleRangeStart;
+  int endSample = renderOptions.sampleRangeCount > 0 ? rangeStart + renderOptions.sampleRangeCount : samplesPerPixel;
+  // Samples every pixel already has.
+  int firstSample = rangeStart;
+  image.set_sample_count(rangeStart);
+
+  if(!renderOptions.resumePath.empty()) {
+    auto saved = Checkpoint::load(renderOptions.resumePath, checkpointKey, imageWidth, imageHeight);
+    if(saved && saved->firstSample != rangeStart) {
+      std::cerr << fmt("The checkpoint %s starts at sample %d, not %d.\n", renderOptions.resumePath.c_str(), saved->firstSample, rangeStart);
+      saved.reset();
+    } else if(saved && saved->samples > endSample) {
+      // Resolving divides by the samples of this run, more would come out too bright.
+      std::cerr << fmt("The checkpoint %s has %d samples, this run ends at %d.\n", renderOptions.resumePath.c_str(), saved->samples, endSample);
+      saved.reset();
+    }
+    if(!saved) {
+      std::cerr << "Can't resume. Aborting\n";
+      std::exit(EXIT_FAILURE);
+    }
+    image.load_rgba_f32(saved->pixels.data());
+    firstSample = saved->samples;
+    std::cout << fmt("Resuming from %s at %d samples.\n", renderOptions.resumePath.c_str(), saved->samples);
+  }
   image.write_to_device();
 
-  CLBuffer<Sphere> spheres = CLBuffer<Sphere>::fromVector(context, queue, Sphere::instances); 
-  CLBuffer<BVHNode> bvh_nodes = CLBuffer<BVHNode>::fromPtr(context, queue, bvh.getPool(), bvh.getNodesUsed());
+  std::unique_ptr<Checkpoint> checkpoint;
+  if(renderOptions.checkpointEvery > 0 || renderOptions.sampleRangeCount > 0) {
+    checkpoint = std::make_unique<Checkpoint>(context, device, image.clImage, imageWidth, imageHeight, checkpointKey,
+                                              rangeStart, outputFileName + ".ckpt");
+  }
+
+  std::unique_ptr<AdaptiveSampler> adaptive;
+  if(renderOptions.noiseThreshold > 0) {
+    adaptive = std::make_unique<AdaptiveSampler>(context, queue, device, kernelDefines, image.clImage, imageWidth, imageHeight,
+                                                 renderOptions.noiseThreshold, renderOptions.adaptiveMinSamples, samplesPerPixel);
+    kernel = adaptive->kernel();
+  }
+
+  if(!cached) spheres = CLBuffer<Sphere>::fromVector(context, queue, Sphere::instances);
   CLBuffer<Lambertian> lambertians = CLBuffer<Lambertian>::fromVector(context, queue, Lambertian::instances);
   CLBuffer<Metal> metals = CLBuffer<Metal>::fromVector(context, queue, Metal::instances);
   CLBuffer<Dielectric> dielectrics = CLBuffer<Dielectric>::fromVector(context, queue, Dielectric::instances);
@@ -147,43 +588,248 @@ int main(int argc, const char** argv) {
 
   cam.initialize((float)(imageWidth) / imageHeight);
 
-  spheres.uploadToDevice(context);
-  bvh_nodes.uploadToDevice(context);
+  if(!cached) spheres.uploadToDevice(context);
   lambertians.uploadToDevice(context);
   metals.uploadToDevice(context);
   dielectrics.uploadToDevice(context);
   textures.uploadToDevice(context);
 
-  kernelParameters(kernel, 0, image.clImage, spheres, spheres.count(), bvh_nodes, bvh_nodes.count(), seeds, maxDepth, lambertians, metals, dielectrics, textures, cam);
+  if(bvhOptions.builder == BVHBuilder::LBVH) {
+    LBVH(context, queue, device).build(spheres, bvh_nodes);
+  }
+
+  // The kernel was built for one node format, hand it that one.
+  cl_mem traversal_nodes = bvh_nodes.devBuffer();
+  uint traversal_node_count = bvh_nodes.count();
+
+  CLBuffer<BVHSkipNode> skip_nodes(context, queue);
+  CLBuffer<BVH4Node> bvh4_nodes(context, queue);
+  CLBuffer<BVH8Node> bvh8_nodes(context, queue);
+  CLBuffer<BVH4CompressedNode> bvh4c_nodes(context, queue);
+  CLBuffer<BVH8CompressedNode> bvh8c_nodes(context, queue);
+  auto useNodes = [&](auto& buffer) {
+    traversal_nodes = buffer.devBuffer();
+    traversal_node_count = buffer.count();
+  };
+
+  // Any other layout, and the stats, are derived from the binary tree on the host.
+  if(bvhOptions.builder == BVHBuilder::LBVH && (bvhOptions.width > 2 || bvhOptions.traversal != BVHTraversal::Stack || bvhOptions.stats)) {
+    bvh_nodes.readFromDevice();
+  }
+
+  const BVHNode* host_nodes = cached ? cached->nodes() : &bvh_nodes[0];
+
+  std::optional<BVHStats> bvhStats;
+  CLBuffer<cl_ulong> bvhStatsCounters(context, queue);
+  if(bvhOptions.stats) {
+    bvhStats = BVHStats::fromTree(host_nodes, bvh_nodes.count());
+    for(int i = 0; i < BVH_STAT_COUNT; i++) bvhStatsCounters.push_back(0);
+    bvhStatsCounters.uploadToDevice(context);
+  }
+
+  if(bvhOptions.traversal == BVHTraversal::SkipLinks) {
+    SkipLinkBVH skip(host_nodes, bvh_nodes.count());
+    useNodes(skip_nodes = uploadNodes(context, queue, skip.getNodes()));
+  } else if(bvhOptions.width > 2) {
+    auto checkStack = [](const std::string& error) {
+      if(error.empty()) return;
+      std::cerr << error << " Aborting\n";
+      std::exit(EXIT_FAILURE);
+    };
+
+    if(bvhOptions.width == 4) {
+      BVH4 wide(host_nodes, bvh_nodes.count());
+      checkStack(wide.stackError());
+      if(bvhOptions.compressed) useNodes(bvh4c_nodes = uploadNodes(context, queue, wide.compress()));
+      else                      useNodes(bvh4_nodes = uploadNodes(context, queue, wide.getNodes()));
+    } else {
+      BVH8 wide(host_nodes, bvh_nodes.count());
+      checkStack(wide.stackError());
+      if(bvhOptions.compressed) useNodes(bvh8c_nodes = uploadNodes(context, queue, wide.compress()));
+      else                      useNodes(bvh8_nodes = uploadNodes(context, queue, wide.getNodes()));
+    }
+  }
+
+  // Next pixel for the persistent integrator to hand out.
+  CLBuffer<uint> workCounter(context, queue);
+  workCounter.push_back(0);
+  workCounter.uploadToDevice(context);
+
+  if(wavefront) {
+    wavefront->setScene(image.clImage, spheres, traversal_nodes, traversal_node_count, lambertians, metals, dielectrics, textures, cam,
+                        bvhOptions.stats ? &bvhStatsCounters : nullptr);
+  } else {
+    kernelParameters(kernel, 0, image.clImage, spheres, spheres.count(), traversal_nodes, traversal_node_count, maxDepth, lambertians, metals, dielectrics, textures, cam);
+    // samples_per_launch is set per launch.
+    uint statsIndex = 12;
+    if(adaptive) {
+      statsIndex = AdaptiveSampler::statsIndex;
+    } else if(renderOptions.integrator == Integrator::Persistent) {
+      kernelParameters(kernel, statsIndex++, workCounter);
+    }
+    // Only there with -DBVH_STATS, last.
+    if(bvhOptions.stats) kernelParameters(kernel, statsIndex, bvhStatsCounters);
+  }
+
+  const size_t persistentLocalSize = 64;
+  size_t persistentGlobalSize = persistentLocalSize * (renderOptions.persistentGroups > 0
+      ? renderOptions.persistentGroups : persistentGroupCount(device, persistentLocalSize));
 
-  cl_event event;
   std::array<size_t, 2> image_size{(std::size_t)image.width, (std::size_t)image.height};
   std::array<size_t, 2> zero_offset{0, 0};
   std::array<size_t, 2> local_work_size{16, 16};
 
   std::cout << fmt("Output file name: %s\n", outputFileName.c_str())
-            << fmt("Raytracing with resolution: %dx%d, samples: %d, max depth: %d\n", imageWidth, imageHeight, samplesPerPixel, maxDepth)
+            << fmt("Raytracing with resolution: %dx%d, samples: %d (%d per launch), max depth: %d, integrator: %s, sampler: %s\n", imageWidth, imageHeight,
+                   samplesPerPixel, renderOptions.samplesPerLaunch, maxDepth, integratorName(renderOptions.integrator),
+                   samplerName(renderOptions.sampler))
+            << (renderOptions.sampleRangeCount > 0 ? fmt("Sample range: %d to %d\n", rangeStart, endSample) : "")
+            // So the M samples/s at the end say which node format they're for.
+            << fmt("BVH nodes: %d-wide%s\n", bvhOptions.width, bvhOptions.compressed ? ", compressed"
+                   : bvhOptions.traversal == BVHTraversal::SkipLinks ? ", skip links" : "")
             << fmt("# Spheres: %d, Lambertians: %d, Metals: %d, Dielectrics: %d\n", spheres.count(), lambertians.count(), metals.count(), dielectrics.count())
             << fmt("# Textures: %d\n", textures.count())
             << std::setfill('0') << std::setw(5) << std::fixed << std::setprecision(2);
 
   auto start = high_resolution_clock::now();
-  for (int i = 0 ; i < samplesPerPixel; i++) {
-    auto current_time = duration_cast<milliseconds>(high_resolution_clock::now()-start);
+  double tracedSamples = (double)imageWidth * imageHeight * (endSample - firstSample);
 
-    // Specifying a local workgroup size doesn't seem to improve performance at all..
-    clErr(clEnqueueNDRangeKernel(queue, kernel, 2, zero_offset.data(), image_size.data(), local_work_size.data(), 0, NULL, &event));
-    clErr(clWaitForEvents(1, &event));
+  if(adaptive) {
+    for(int done = 0; done < samplesPerPixel && adaptive->active() > 0; ) {
+      int samples = std::min(renderOptions.samplesPerLaunch, samplesPerPixel - done);
+      adaptive->pass(samples);
+      done += samples;
 
-    auto percentage = ((i + 1.f)/samplesPerPixel) * 100.f;
-    std::cout << fmt("\r[%d ms] Sample progress: %.2f%%", current_time.count(), percentage) << std::flush;
+      auto current_time = duration_cast<milliseconds>(high_resolution_clock::now()-start);
+      std::cout << fmt("\r[%d ms] Samples: %d, active pixels: %.2f%%", current_time.count(), done,
+                       100.0 * adaptive->active() / (imageWidth * imageHeight)) << std::flush;
+    }
+    tracedSamples = adaptive->samples();
+  } else {
+    // Everything is enqueued up front, the device never waits on the host.
+    // Progress comes from the event callback of each launch. With
+    // checkpoints, only a few launches are queued ahead, so a snapshot can go
+    // in between any two of them.
+    bool periodicCheckpoints = renderOptions.checkpointEvery > 0;
+    int launchCount = (endSample - firstSample + renderOptions.samplesPerLaunch - 1) / renderOptions.samplesPerLaunch;
+    int launchesAhead = periodicCheckpoints ? 2 : launchCount;
+    std::vector<Launch> launches(launchCount);
+    SampleProgress progress;
+    progress.done = firstSample;
+
+    int enqueued = 0, enqueuedSamples = firstSample;
+    int nextCheckpointSamples = firstSample + renderOptions.checkpointEvery;
+    auto lastCheckpoint = start;
+
+    // Once `done` samples have finished.
+    auto enqueueLaunches = [&](int done) {
+      for(; enqueued < launchCount && enqueuedSamples - done < launchesAhead * renderOptions.samplesPerLaunch; enqueued++) {
+        bool checkpointDue = renderOptions.checkpointInSamples
+          ? enqueuedSamples >= nextCheckpointSamples
+          : high_resolution_clock::now() - lastCheckpoint >= milliseconds(renderOptions.checkpointEvery);
+        if(periodicCheckpoints && enqueued > 0 && checkpointDue && !checkpoint->busy()) {
+          cl_event copied = checkpoint->save(launches[enqueued - 1].event, enqueuedSamples);
+          clErr(clEnqueueBarrierWithWaitList(queue, 1, &copied, nullptr));
+          clReleaseEvent(copied);
+          nextCheckpointSamples = enqueuedSamples + renderOptions.checkpointEvery;
+          lastCheckpoint = high_resolution_clock::now();
+        }
+
+        Launch& launch = launches[enqueued];
+        launch.progress = &progress;
+        launch.samples = std::min(renderOptions.samplesPerLaunch, endSample - enqueuedSamples);
+        enqueuedSamples += launch.samples;
+
+        if(wavefront) {
+          for(int s = 0; s < launch.samples; s++) wavefront->enqueueSample();
+          clErr(clEnqueueMarkerWithWaitList(queue, 0, nullptr, &launch.event));
+        } else if(renderOptions.integrator == Integrator::Persistent) {
+          const uint zero = 0;
+          kernelParameters(kernel, 11, launch.samples);
+          clErr(clEnqueueFillBuffer(queue, workCounter.devBuffer(), &zero, sizeof(zero), 0, sizeof(zero), 0, nullptr, nullptr));
+          clErr(clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &persistentGlobalSize, &persistentLocalSize, 0, NULL, &launch.event));
+        } else {
+          kernelParameters(kernel, 11, launch.samples);
+          // Specifying a local workgroup size doesn't seem to improve performance at all..
+          clErr(clEnqueueNDRangeKernel(queue, kernel, 2, zero_offset.data(), image_size.data(), local_work_size.data(), 0, NULL, &launch.event));
+        }
+
+        clErr(clSetEventCallback(launch.event, CL_COMPLETE, onLaunchComplete, &launch));
+      }
+      clErr(clFlush(queue));
+    };
+
+    {
+      std::unique_lock lock(progress.mutex);
+      while(progress.done < endSample) {
+        int seen = progress.done;
+        lock.unlock();
+        enqueueLaunches(seen);
+        lock.lock();
+        progress.changed.wait(lock, [&] { return progress.done != seen; });
+
+        auto current_time = duration_cast<milliseconds>(high_resolution_clock::now()-start);
+        auto percentage = ((float)(progress.done - rangeStart)/(endSample - rangeStart)) * 100.f;
+        std::cout << fmt("\r[%d ms] Sample progress: %.2f%%", current_time.count(), percentage) << std::flush;
+      }
+    }
+    clErr(progress.status);
+    clErr(clFinish(queue));
+    for(Launch& launch : launches) clReleaseEvent(launch.event);
   }
+
   auto end = high_resolution_clock::now();
   std::cout << "\rDone.                                        \n"
-            << fmt("Raytracing done in %d ms\n", duration_cast<milliseconds>(end-start));
-  
-  image.read_from_device();
-  image.write_to_file(outputFileName, samplesPerPixel);
+            << fmt("Raytracing done in %d ms (%.2f M samples/s)\n", duration_cast<milliseconds>(end-start),
+                   tracedSamples / duration_cast<microseconds>(end-start).count());
+  if(adaptive) {
+    std::cout << fmt("Adaptive sampling took %.2f samples per pixel on average, %.2f%% of a full render.\n",
+                     tracedSamples / (imageWidth * imageHeight), 100.0 * tracedSamples / ((double)imageWidth * imageHeight * samplesPerPixel));
+  }
+  if(renderOptions.checkpointEvery > 0) {
+    checkpoint->wait();
+    std::cout << fmt("%d checkpoints written to %s\n", checkpoint->count(), checkpoint->file().c_str());
+  }
+  if(renderOptions.sampleRangeCount > 0) {
+    checkpoint->wait();
+    int written = checkpoint->count();
+    clReleaseEvent(checkpoint->save(nullptr, endSample));
+    checkpoint->wait();
+    if(checkpoint->count() > written) {
+      std::cout << fmt("Samples %d to %d left in %s for sample_merge\n", rangeStart, endSample, checkpoint->file().c_str());
+    }
+  }
+
+  ImageFormat format = renderOptions.outputFormat.value_or(imageFormatFromPath(outputFileName));
+  ImageWriter writer(imageWidth, imageHeight);
+  // Adaptive pixels have their own sample count, in alpha.
+  int resolveSamples = adaptive ? 0 : endSample - rangeStart;
+  bool written;
+
+  if(imageFormatIsHdr(format)) {
+    image.read_from_device();
+    written = writer.write(outputFileName, format, image.pixels(), resolveSamples);
+  } else {
+    ImageResolve resolve(context, queue, device, image.clImage, imageWidth, imageHeight);
+    written = writer.write(outputFileName, format, resolve.resolve(resolveSamples));
+  }
+  if(written) std::cout << fmt("Image successfully written at %s (%s)\n", outputFileName.c_str(), imageFormatName(format));
+
+  if(!renderOptions.sampleHeatmapPath.empty()) {
+    if(!imageFormatIsHdr(format)) image.read_from_device();
+    image.write_sample_heatmap(renderOptions.sampleHeatmapPath, samplesPerPixel);
+  }
+
+  if(bvhStats) {
+    bvhStatsCounters.readFromDevice();
+    std::copy(bvhStatsCounters.begin(), bvhStatsCounters.end(), bvhStats->counters.begin());
+    bvhStats->hasCounters = true;
+
+    bvhStats->print(std::cout);
+    if(!bvhOptions.statsJsonPath.empty() && !bvhStats->writeJson(bvhOptions.statsJsonPath)) {
+      std::cerr << fmt("Couldn't write the BVH stats to %s.\n", bvhOptions.statsJsonPath.c_str());
+    }
+  }
   
 	return EXIT_SUCCESS;
 }
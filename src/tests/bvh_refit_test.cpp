@@ -0,0 +1,156 @@
+// Bounces spheres the way the random spheres scene animates them, refits the
+// tree on the host with BVH::refit and on the device with BVHRefitter, and
+// checks both against the moved spheres, a fresh build and each other. The
+// device half needs an OpenCL device and is skipped without one. Run it from
+// the repository root, like CRT.
+
+#include "host/BVH.h"
+#include "host/BVHRefit.h"
+#include "host/CLBuffer.h"
+#include "host/CLUtil.h"
+#include "host/Random.h"
+#include "host/Utils.h"
+#include "host/builtin_scenes.h"
+
+#include <CL/cl.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+// ctest's SKIP_RETURN_CODE, see CMakeLists.txt.
+#define SKIPPED 77
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+  if(!ok) {
+    std::cerr << "FAILED: " << what << "\n";
+    failures++;
+  }
+}
+
+static bool sameBounds(const AABB& a, const AABB& b) {
+  const float eps = 1e-5f;
+  for(int axis = 0; axis < 3; axis++) {
+    if(std::fabs(a.axis(axis).min - b.axis(axis).min) > eps || std::fabs(a.axis(axis).max - b.axis(axis).max) > eps) return false;
+  }
+  return true;
+}
+
+// Every leaf bounds exactly its spheres and every inner node its children.
+static void checkTight(const BVHNode* nodes, uint count, const Sphere* spheres) {
+  for(uint i = 0; i < count; i++) {
+    const BVHNode& node = nodes[i];
+    if(node.sphere_count == 0 && node.left_first == 0) continue;
+
+    AABB expected;
+    if(node.sphere_count > 0) {
+      for(uint s = node.left_first; s < node.left_first + node.sphere_count; s++) {
+        Sphere moved = spheres[s];
+        moved.updateBBox();
+        expected.grow(moved.bbox);
+      }
+    } else {
+      expected = nodes[node.left_first].bounds;
+      expected.grow(nodes[node.left_first + 1].bounds);
+    }
+
+    if(!sameBounds(node.bounds, expected)) {
+      check(false, fmt("node %u doesn't bound its %s", i, node.sphere_count > 0 ? "spheres" : "children"));
+      return;
+    }
+  }
+}
+
+static void bounce(Sphere* spheres, uint count) {
+  for(uint i = 0; i < count; i++) {
+    spheres[i].center.s[1] += builtin_scene_bounce(0, spheres[i], 0.5f) - builtin_scene_bounce(0, spheres[i], 0);
+  }
+}
+
+// Swaps the small spheres across the scene, which leaves every leaf spanning
+// it. The cost must call for a rebuild.
+static void scatter(Sphere* spheres, uint count) {
+  std::vector<uint> small;
+  for(uint i = 0; i < count; i++) {
+    if(spheres[i].radius < 0.5f) small.push_back(i);
+  }
+  for(size_t i = 0; i < small.size() / 2; i++) {
+    std::swap(spheres[small[i]].center, spheres[small[small.size() - 1 - i]].center);
+  }
+}
+
+int main() {
+  // Small spheres in a cube. The ground of the random spheres scene is so big
+  // that it makes up nearly all of the SAH cost, however the others move.
+  srand(42);
+  for(int i = 0; i < 1000; i++) {
+    float3 center = f3(randomFloatRanged(-10, 10), randomFloatRanged(-10, 10), randomFloatRanged(-10, 10));
+    Sphere::instances.push_back(Sphere(center, 0.2f, MaterialId{}));
+  }
+
+  // The host refit, on its own copy of the spheres.
+  BVHBuildOptions options;
+  std::vector<Sphere> hostSpheres = Sphere::instances;
+  BVH hostBvh(hostSpheres, options);
+
+  bounce(hostSpheres.data(), hostSpheres.size());
+  check(!hostBvh.refit(), "a bounce shouldn't ask the host refit for a rebuild");
+  checkTight(hostBvh.getPool(), hostBvh.getNodesUsed(), hostSpheres.data());
+  std::vector<BVHNode> hostBounced(hostBvh.getPool(), hostBvh.getPool() + hostBvh.getNodesUsed());
+
+  scatter(hostSpheres.data(), hostSpheres.size());
+  check(hostBvh.refit(), "scattering the spheres should ask the host refit for a rebuild");
+  checkTight(hostBvh.getPool(), hostBvh.getNodesUsed(), hostSpheres.data());
+
+  cl_uint platformCount = 0;
+  if(clGetPlatformIDs(0, nullptr, &platformCount) != CL_SUCCESS || platformCount == 0) {
+    if(failures > 0) return EXIT_FAILURE;
+    std::cerr << "No OpenCL platform, skipping the device refit.\n";
+    return SKIPPED;
+  }
+
+  auto [context, queue, device] = setupCL();
+
+  BVH bvh(Sphere::instances, options);
+  auto nodes = CLBuffer<BVHNode>::fromPtr(context, queue, bvh.getPool(), bvh.getNodesUsed());
+  nodes.uploadToDevice(context);
+  auto spheres = CLBuffer<Sphere>::fromVector(context, queue, Sphere::instances);
+  spheres.uploadToDevice(context);
+
+  BVHRefitter refitter(context, queue, device);
+  refitter.setTree(nodes);
+
+  // A bounce moves the spheres a little, refitting is enough.
+  bounce(&spheres[0], spheres.count());
+  spheres.writeToDevice();
+
+  check(!refitter.refit(spheres, nodes), "a bounce shouldn't ask for a rebuild");
+  nodes.readFromDevice();
+  checkTight(&nodes[0], nodes.count(), &spheres[0]);
+
+  // Both trees were built from the same spheres, so they refit to the same bounds.
+  check(nodes.count() == hostBounced.size(), "the host and device trees differ in size");
+  for(uint i = 0; i < std::min<size_t>(nodes.count(), hostBounced.size()); i++) {
+    if(!sameBounds(nodes[i].bounds, hostBounced[i].bounds)) {
+      check(false, fmt("the host and device refits disagree at node %u", i));
+      break;
+    }
+  }
+
+  std::vector<Sphere> moved(spheres.begin(), spheres.end());
+  BVH fresh(moved, options);
+  check(sameBounds(nodes[0].bounds, fresh.getPool()[0].bounds), "the refitted root differs from a fresh build's");
+
+  scatter(&spheres[0], spheres.count());
+  spheres.writeToDevice();
+
+  check(refitter.refit(spheres, nodes), "scattering the spheres should ask for a rebuild");
+  nodes.readFromDevice();
+  checkTight(&nodes[0], nodes.count(), &spheres[0]);
+
+  if(failures == 0) std::cout << "All refit checks passed.\n";
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,113 @@
+// Merges the accumulation images that renders with --sample-range leave
+// behind (see host/Checkpoint.h) into the image of all their samples, then
+// resolves and writes it like CRT does.
+//
+// Usage: sample_merge [{--output , -o} filename (default: output.ppm)] [--format format] shard.ckpt...
+// Run it from the repository root, like CRT, the 8-bit formats resolve on the device.
+//
+// To split a frame of 256 samples over 4 processes:
+//   CRT --samples 256 --sample-range 0:64 -o a.ppm
+//   ...
+//   CRT --samples 256 --sample-range 192:64 -o d.ppm
+//   sample_merge -o frame.png a.ppm.ckpt b.ppm.ckpt c.ppm.ckpt d.ppm.ckpt
+
+#include "host/CLUtil.h"
+#include "host/Checkpoint.h"
+#include "host/ImageResolve.h"
+#include "host/ImageWriter.h"
+#include "host/PPM.h"
+#include "host/Utils.h"
+
+#include <CL/cl.h>
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+int main(int argc, const char** argv) {
+  std::string outputFileName = "output.ppm";
+  std::optional<ImageFormat> outputFormat;
+  std::vector<std::string> shardPaths;
+
+  for(int i = 1; i < argc; i++) {
+    if((STR_EQ(argv[i], "-o") || STR_EQ(argv[i], "--output")) && i + 1 < argc) {
+      outputFileName = argv[++i];
+    } else if(STR_EQ(argv[i], "--format") && i + 1 < argc) {
+      outputFormat = imageFormatFromName(argv[++i]);
+      if(!outputFormat) {
+        std::cerr << fmt("Invalid value for the argument \"format\" (%s). Aborting\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if(argv[i][0] == '-') {
+      std::cerr << fmt("Usage: %s [{--output , -o} filename] [--format {ppm,p3,pfm,png,exr}] shard.ckpt...\n", argv[0]);
+      return STR_EQ(argv[i], "--help") ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else {
+      shardPaths.push_back(argv[i]);
+    }
+  }
+
+  if(shardPaths.empty()) {
+    std::cerr << "No shards to merge. Aborting\n";
+    return EXIT_FAILURE;
+  }
+
+  std::vector<Checkpoint::Saved> shards;
+  for(const std::string& path : shardPaths) {
+    auto shard = Checkpoint::read(path);
+    if(!shard) return EXIT_FAILURE;
+
+    const Checkpoint::Saved* first = shards.empty() ? &*shard : &shards[0];
+    if(shard->key != first->key || shard->width != first->width || shard->height != first->height) {
+      std::cerr << fmt("%s is of another scene or configuration than %s. Aborting\n", path.c_str(), shardPaths[0].c_str());
+      return EXIT_FAILURE;
+    }
+    shards.push_back(std::move(*shard));
+  }
+
+  // Summed in sample order, the closest to the order one render adds them in.
+  std::sort(shards.begin(), shards.end(), [](const auto& a, const auto& b) { return a.firstSample < b.firstSample; });
+
+  int samples = 0;
+  for(size_t i = 0; i < shards.size(); i++) {
+    if(i > 0 && shards[i].firstSample < shards[i - 1].samples) {
+      std::cerr << fmt("Shards with samples %d to %d and %d to %d overlap. Aborting\n", shards[i - 1].firstSample,
+                       shards[i - 1].samples, shards[i].firstSample, shards[i].samples);
+      return EXIT_FAILURE;
+    }
+    if(i > 0 && shards[i].firstSample > shards[i - 1].samples) {
+      std::cerr << fmt("Samples %d to %d are missing, the image will be noisier.\n", shards[i - 1].samples, shards[i].firstSample);
+    }
+    std::cout << fmt("Samples %d to %d\n", shards[i].firstSample, shards[i].samples);
+    samples += shards[i].samples - shards[i].firstSample;
+  }
+
+  // Alpha of the sum counts all the samples.
+  std::vector<float> merged = std::move(shards[0].pixels);
+  for(size_t i = 1; i < shards.size(); i++) {
+    for(size_t p = 0; p < merged.size(); p += 4) {
+      for(int c = 0; c < 3; c++) merged[p + c] += shards[i].pixels[p + c];
+    }
+  }
+  for(size_t p = 3; p < merged.size(); p += 4) merged[p] = samples;
+
+  const uint width = shards[0].width, height = shards[0].height;
+  ImageFormat format = outputFormat.value_or(imageFormatFromPath(outputFileName));
+  ImageWriter writer(width, height);
+  bool written;
+
+  if(imageFormatIsHdr(format)) {
+    written = writer.write(outputFileName, format, merged.data(), samples);
+  } else {
+    auto [context, queue, device] = setupCL();
+    PPMImage image = PPMImage::black(queue, context, width, height);
+    image.load_rgba_f32(merged.data());
+    image.write_to_device();
+
+    ImageResolve resolve(context, queue, device, image.clImage, width, height);
+    written = writer.write(outputFileName, format, resolve.resolve(samples));
+  }
+  if(!written) return EXIT_FAILURE;
+
+  std::cout << fmt("%d samples from %zu shards merged into %s (%s)\n", samples, shards.size(), outputFileName.c_str(), imageFormatName(format));
+  return EXIT_SUCCESS;
+}